@@ -39,6 +39,7 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "ae.h"
 #include "zmalloc.h"
@@ -60,6 +61,37 @@
     #endif
 #endif
 
+/* The io_uring module may replace the one above in a loop, see aeSetApi(). */
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#if defined(IORING_ENTER_EXT_ARG) && defined(IORING_POLL_ADD_MULTI) && \
+    defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_RECV_MULTISHOT)
+#include "ae_iouring.c"
+#else
+#undef HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#define AE_API(eventLoop, fn) ((eventLoop)->uring ? aeUring##fn : aeApi##fn)
+#else
+#define AE_API(eventLoop, fn) ((void)(eventLoop), aeApi##fn)
+#endif
+
+/* Read the monotonic clock once for the callbacks of an iteration of the
+ * loop. Timers are scheduled from this time too. */
+void aeUpdateTime(aeEventLoop *eventLoop) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    eventLoop->cachedTime = (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Microseconds of the monotonic clock at the last aeUpdateTime(). */
+long long aeGetTime(aeEventLoop *eventLoop) {
+    return eventLoop->cachedTime;
+}
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
@@ -69,12 +101,24 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    aeUpdateTime(eventLoop);
+    eventLoop->timeNow = eventLoop->cachedTime/1000;
+    for (i = 0; i < AE_WHEEL_LISTS; i++)
+        eventLoop->timeLists[i] = NULL;
+    for (i = 0; i < AE_WHEEL_LEVELS; i++)
+        eventLoop->timeBits[i] = 0;
+    eventLoop->timeEvents = 0;
+    eventLoop->timeEventTable = NULL;
+    eventLoop->timeEventFree = NULL;
+    eventLoop->timeEventFreeCount = 0;
+    eventLoop->timeEventTableSize = 0;
+    eventLoop->timeEventRunning = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
+    eventLoop->flags = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->uring = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -108,7 +152,7 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 
     if (setsize == eventLoop->setsize) return AE_OK;
     if (eventLoop->maxfd >= setsize) return AE_ERR;
-    if (aeApiResize(eventLoop,setsize) == -1) return AE_ERR;
+    if (AE_API(eventLoop, Resize)(eventLoop,setsize) == -1) return AE_ERR;
 
     eventLoop->events = zrealloc(eventLoop->events,sizeof(aeFileEvent)*setsize);
     eventLoop->fired = zrealloc(eventLoop->fired,sizeof(aeFiredEvent)*setsize);
@@ -122,7 +166,13 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
-    aeApiFree(eventLoop);
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventTableSize; j++)
+        zfree(eventLoop->timeEventTable[j]);
+    zfree(eventLoop->timeEventTable);
+    zfree(eventLoop->timeEventFree);
+    AE_API(eventLoop, Free)(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
@@ -141,7 +191,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
     }
     aeFileEvent *fe = &eventLoop->events[fd];
 
-    if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+    if (AE_API(eventLoop, AddEvent)(eventLoop, fd, mask) == -1)
         return AE_ERR;
     fe->mask |= mask;
     if (mask & AE_READABLE) fe->rfileProc = proc;
@@ -158,7 +208,9 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
     aeFileEvent *fe = &eventLoop->events[fd];
     if (fe->mask == AE_NONE) return;
 
-    aeApiDelEvent(eventLoop, fd, mask);
+    /* AE_EDGE goes with the last event. */
+    if (!(fe->mask & ~mask & (AE_READABLE|AE_WRITABLE))) mask |= AE_EDGE;
+    AE_API(eventLoop, DelEvent)(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         /* Update the max fd */
@@ -177,158 +229,227 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
+/* Link the event in the list of the wheel for its time: the lowest level
+ * where it shares the upper slots with now, so that it is cascaded down
+ * when now gets there. Events already due wait for the next processing. */
+static void aeWheelLink(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    unsigned long long diff;
+    int level = 0, list;
+
+    if (te->when < eventLoop->timeNow) {
+        list = AE_WHEEL_EXPIRED;
+    } else {
+        diff = (unsigned long long)(te->when ^ eventLoop->timeNow);
+        if (diff) level = (63 - __builtin_clzll(diff)) / AE_WHEEL_BITS;
+        if (level >= AE_WHEEL_LEVELS) {
+            list = AE_WHEEL_OVERFLOW;
+        } else {
+            int slot = (te->when >> (level*AE_WHEEL_BITS)) & (AE_WHEEL_SIZE-1);
+            list = level*AE_WHEEL_SIZE + slot;
+            eventLoop->timeBits[level] |= 1ULL << slot;
+        }
+    }
+    te->list = list;
+    te->prev = NULL;
+    te->next = eventLoop->timeLists[list];
+    if (te->next) te->next->prev = te;
+    eventLoop->timeLists[list] = te;
+}
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+static void aeWheelUnlink(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->prev)
+        te->prev->next = te->next;
+    else
+        eventLoop->timeLists[te->list] = te->next;
+    if (te->next) te->next->prev = te->prev;
+    if (te->list < AE_WHEEL_EXPIRED && !eventLoop->timeLists[te->list])
+        eventLoop->timeBits[te->list / AE_WHEEL_SIZE] &= ~(1ULL << (te->list % AE_WHEEL_SIZE));
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* Link again every event of a list, for a now which moved. */
+static void aeWheelRelink(aeEventLoop *eventLoop, int list) {
+    aeTimeEvent *te;
+
+    if (list < AE_WHEEL_EXPIRED)
+        eventLoop->timeBits[list / AE_WHEEL_SIZE] &= ~(1ULL << (list % AE_WHEEL_SIZE));
+    te = eventLoop->timeLists[list];
+    eventLoop->timeLists[list] = NULL;
+    while (te) {
+        aeTimeEvent *next = te->next;
+        aeWheelLink(eventLoop, te);
+        te = next;
+    }
+}
+
+/* The next millisecond when the wheel has something to do: the first slot
+ * not empty of the lowest level, to fire it or to cascade its events down,
+ * LLONG_MAX without timers. The current slot of every upper level is always
+ * empty, see aeWheelMove(). */
+static long long aeWheelNext(aeEventLoop *eventLoop) {
+    long long t = eventLoop->timeNow;
+    int level;
+
+    for (level = 0; level < AE_WHEEL_LEVELS; level++) {
+        int shift = level*AE_WHEEL_BITS;
+        int slot = (t >> shift) & (AE_WHEEL_SIZE-1);
+        unsigned long long bits = eventLoop->timeBits[level] >> slot;
+
+        if (bits) {
+            long long when = ((t >> shift) + __builtin_ctzll(bits)) << shift;
+            return when > t ? when : t;
+        }
+    }
+    if (eventLoop->timeLists[AE_WHEEL_OVERFLOW])
+        return ((t >> (AE_WHEEL_LEVELS*AE_WHEEL_BITS)) + 1) << (AE_WHEEL_LEVELS*AE_WHEEL_BITS);
+    return LLONG_MAX;
+}
+
+static void aeWheelDue(aeEventLoop *eventLoop, int list) {
+    aeTimeEvent *te;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while ((te = eventLoop->timeLists[list])) {
+        aeWheelUnlink(eventLoop, te);
+        te->list = AE_WHEEL_DUE;
+        te->prev = NULL;
+        te->next = eventLoop->timeLists[AE_WHEEL_DUE];
+        if (te->next) te->next->prev = te;
+        eventLoop->timeLists[AE_WHEEL_DUE] = te;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+}
+
+/* Set timeNow to t. When t begins a slot of the upper levels, cascade the
+ * events of those slots down, from the highest which may fill the slots
+ * below, so that the current slot of an upper level stays empty. */
+static void aeWheelMove(aeEventLoop *eventLoop, long long t) {
+    int level = 1;
+
+    eventLoop->timeNow = t;
+    if (t & (AE_WHEEL_SIZE-1)) return;
+    while (level < AE_WHEEL_LEVELS && !((t >> (level*AE_WHEEL_BITS)) & (AE_WHEEL_SIZE-1)))
+        level++;
+    if (level == AE_WHEEL_LEVELS)
+        aeWheelRelink(eventLoop, AE_WHEEL_OVERFLOW);
+    else
+        level++;
+    while (--level > 0)
+        aeWheelRelink(eventLoop, level*AE_WHEEL_SIZE + ((t >> (level*AE_WHEEL_BITS)) & (AE_WHEEL_SIZE-1)));
+}
+
+/* Move the events of every millisecond up to now in the list of due events,
+ * jumping over the empty slots. */
+static void aeWheelAdvance(aeEventLoop *eventLoop, long long now) {
+    long long t;
+
+    while ((t = aeWheelNext(eventLoop)) <= now) {
+        if (t != eventLoop->timeNow) aeWheelMove(eventLoop, t);
+        aeWheelDue(eventLoop, t & (AE_WHEEL_SIZE-1));
+        aeWheelMove(eventLoop, t + 1);
+    }
+    if (eventLoop->timeNow <= now)
+        aeWheelMove(eventLoop, now + 1);
+}
+
+/* Milliseconds until the wheel has something to do, -1 without timers. */
+static long long aeWheelTimeout(aeEventLoop *eventLoop, long long now) {
+    long long when;
+
+    if (eventLoop->timeLists[AE_WHEEL_EXPIRED]) return 0;
+    when = aeWheelNext(eventLoop);
+    if (when == LLONG_MAX) return -1;
+    return when > now ? when - now : 0;
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
+    int index;
+
+    if (!eventLoop->timeEventFreeCount) {
+        int j, size = eventLoop->timeEventTableSize ? eventLoop->timeEventTableSize*2 : 64;
+        aeTimeEvent **table = zrealloc(eventLoop->timeEventTable, sizeof(*table)*size);
+        int *free = zrealloc(eventLoop->timeEventFree, sizeof(*free)*size);
 
+        if (table == NULL || free == NULL) return AE_ERR;
+        for (j = size-1; j >= eventLoop->timeEventTableSize; j--) {
+            table[j] = NULL;
+            free[eventLoop->timeEventFreeCount++] = j;
+        }
+        eventLoop->timeEventTable = table;
+        eventLoop->timeEventFree = free;
+        eventLoop->timeEventTableSize = size;
+    }
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    /* The slot of the table in the low bits, a sequence above so that the
+     * id of a deleted event is never found again. The sequence wraps in 31
+     * bits to keep the ids positive, a slot is not reused 2^31 times while
+     * an id of it is still around. */
+    index = eventLoop->timeEventFree[--eventLoop->timeEventFreeCount];
+    te->id = (long long)((eventLoop->timeEventNextId++ & 0x7fffffff) << 32) | index;
+    te->when = eventLoop->cachedTime/1000 + milliseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    eventLoop->timeEventTable[index] = te;
+    eventLoop->timeEvents++;
+    aeWheelLink(eventLoop, te);
+    return te->id;
 }
 
-int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
-{
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te, int index) {
+    eventLoop->timeEventTable[index] = NULL;
+    eventLoop->timeEventFree[eventLoop->timeEventFreeCount++] = index;
+    eventLoop->timeEvents--;
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
+int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
+    int index = (int)(id & 0xffffffff);
+    aeTimeEvent *te;
+
+    if (id < 0 || index >= eventLoop->timeEventTableSize) return AE_ERR;
+    te = eventLoop->timeEventTable[index];
+    if (te == NULL || te->id != id) return AE_ERR; /* NO event with the specified ID found */
+    /* The event being processed is freed once its proc returns. */
+    if (te == eventLoop->timeEventRunning) {
+        te->id = AE_DELETED_EVENT_ID;
+        return AE_OK;
     }
-    return nearest;
+    aeWheelUnlink(eventLoop, te);
+    aeFreeTimeEvent(eventLoop, te, index);
+    return AE_OK;
 }
 
-/* Process time events */
+/* Process time events. Events created or rescheduled by the procs are due
+ * at the next processing at the soonest. */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
-
-    prev = NULL;
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
-            continue;
-        }
+    long long now = eventLoop->cachedTime/1000;
+    aeTimeEvent *te;
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+    aeWheelDue(eventLoop, AE_WHEEL_EXPIRED);
+    aeWheelAdvance(eventLoop, now);
+    while ((te = eventLoop->timeLists[AE_WHEEL_DUE])) {
+        long long id = te->id;
+        int index = (int)(id & 0xffffffff);
+        int retval;
+
+        aeWheelUnlink(eventLoop, te);
+        eventLoop->timeEventRunning = te;
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        eventLoop->timeEventRunning = NULL;
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            te->when = now + retval;
+            aeWheelLink(eventLoop, te);
+        } else {
+            aeFreeTimeEvent(eventLoop, te, index);
         }
-        prev = te;
-        te = te->next;
     }
     return processed;
 }
@@ -344,6 +465,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
  * if flags has AE_TIME_EVENTS set, time events are processed.
  * if flags has AE_DONT_WAIT set the function returns ASAP until all
  * the events that's possible to process without to wait are processed.
+ * The loop may be set not to wait too, see aeSetDontWait().
  *
  * The function returns the number of events processed. */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
@@ -352,38 +474,27 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
+    flags |= eventLoop->flags;
 
+    aeUpdateTime(eventLoop);
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
-     * to fire. */
-    if (eventLoop->maxfd != -1 ||
+     * to fire. The completion events of io_uring have no fd there. */
+    if (eventLoop->maxfd != -1 || eventLoop->uring ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         int j;
-        aeTimeEvent *shortest = NULL;
+        long long ms = -1;
         struct timeval tv, *tvp;
 
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-            shortest = aeSearchNearestTimer(eventLoop);
-        if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
-            tvp = &tv;
-
+            ms = aeWheelTimeout(eventLoop, eventLoop->cachedTime/1000);
+        if (ms >= 0) {
             /* How many milliseconds we need to wait for the next
              * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
-
-            if (ms > 0) {
-                tvp->tv_sec = ms/1000;
-                tvp->tv_usec = (ms % 1000)*1000;
-            } else {
-                tvp->tv_sec = 0;
-                tvp->tv_usec = 0;
-            }
+            tvp = &tv;
+            tvp->tv_sec = ms/1000;
+            tvp->tv_usec = (ms % 1000)*1000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -397,7 +508,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
-        numevents = aeApiPoll(eventLoop, tvp);
+        numevents = AE_API(eventLoop, Poll)(eventLoop, tvp);
+        aeUpdateTime(eventLoop);
+#ifdef HAVE_IO_URING
+        if (eventLoop->uring) processed += aeUringProcess(eventLoop);
+#endif
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -460,6 +575,153 @@ char *aeGetApiName(void) {
     return aeApiName();
 }
 
+/* The multiplexing layer of the loop, aeGetApiName() or one chosen with
+ * aeSetApi(). */
+char *aeGetLoopApiName(aeEventLoop *eventLoop) {
+    return AE_API(eventLoop, Name)();
+}
+
+/* Choose the multiplexing layer of a loop without file events yet by its
+ * name: the one of aeGetApiName(), or "io_uring" when built with it and
+ * the kernel supports it. Returns AE_ERR, the loop unchanged, otherwise. */
+int aeSetApi(aeEventLoop *eventLoop, const char *name) {
+    int uring = 0;
+    void *apidata = eventLoop->apidata;
+
+    if (eventLoop->maxfd != -1) {
+        errno = EBUSY;
+        return AE_ERR;
+    }
+#ifdef HAVE_IO_URING
+    uring = !strcmp(name, aeUringName());
+#endif
+    if (!uring && strcmp(name, aeApiName())) {
+        errno = ENOTSUP;
+        return AE_ERR;
+    }
+    if (uring == eventLoop->uring) return AE_OK;
+
+    eventLoop->uring = uring;
+    if (AE_API(eventLoop, Create)(eventLoop) == -1) {
+        eventLoop->uring = !uring;
+        eventLoop->apidata = apidata;
+        return AE_ERR;
+    }
+    {
+        void *created = eventLoop->apidata;
+
+        eventLoop->uring = !uring;
+        eventLoop->apidata = apidata;
+        AE_API(eventLoop, Free)(eventLoop);
+        eventLoop->uring = uring;
+        eventLoop->apidata = created;
+    }
+    return AE_OK;
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Poll without sleeping while noWait is set, for the work left by the
+ * callbacks to do at the next iteration, e.g. the reads beyond a budget
+ * of edge triggered fds which won't be reported again. */
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
+    if (noWait)
+        eventLoop->flags |= AE_DONT_WAIT;
+    else
+        eventLoop->flags &= ~AE_DONT_WAIT;
+}
+
+/* The completion events need the io_uring module, see aeSetApi(). */
+static int aeCompletion(aeEventLoop *eventLoop, int fd) {
+    if (!eventLoop->uring) {
+        errno = ENOTSUP;
+        return 0;
+    }
+    if (fd < 0 || fd >= eventLoop->setsize) {
+        errno = ERANGE;
+        return 0;
+    }
+    return 1;
+}
+
+/* Accept the connections of the listening socket fd in the kernel, proc
+ * gets each of them, non blocking. */
+int aeCreateAcceptEvent(aeEventLoop *eventLoop, int fd, aeAcceptProc *proc, void *clientData) {
+    if (!aeCompletion(eventLoop, fd)) return AE_ERR;
+#ifdef HAVE_IO_URING
+    return aeUringAcceptAdd(eventLoop, fd, proc, clientData) == -1 ? AE_ERR : AE_OK;
+#else
+    AE_NOTUSED(proc);
+    AE_NOTUSED(clientData);
+    return AE_ERR;
+#endif
+}
+
+/* Receive from fd in the kernel into buffers of the loop, proc gets them as
+ * they come. sentProc is told when what aeSend() queued is all sent.
+ * AE_ERR when the kernel has no ring of provided buffers, Linux 5.19. */
+int aeCreateRecvEvent(aeEventLoop *eventLoop, int fd, aeRecvProc *proc,
+        aeSentProc *sentProc, void *clientData)
+{
+    if (!aeCompletion(eventLoop, fd)) return AE_ERR;
+#ifdef HAVE_IO_URING
+    return aeUringRecvAdd(eventLoop, fd, proc, sentProc, clientData) == -1 ? AE_ERR : AE_OK;
+#else
+    AE_NOTUSED(proc);
+    AE_NOTUSED(sentProc);
+    AE_NOTUSED(clientData);
+    return AE_ERR;
+#endif
+}
+
+/* Stop accepting or receiving on fd, what is queued is still sent. */
+void aeDeleteRecvEvent(aeEventLoop *eventLoop, int fd) {
+    if (!aeCompletion(eventLoop, fd)) return;
+#ifdef HAVE_IO_URING
+    aeUringRecvDel(eventLoop, fd);
+#endif
+}
+
+/* Delete every completion event of fd, what is left to send is dropped.
+ * To be called before fd is closed. */
+void aeDeleteCompletionEvents(aeEventLoop *eventLoop, int fd) {
+    if (!aeCompletion(eventLoop, fd)) return;
+#ifdef HAVE_IO_URING
+    aeUringCompletionDel(eventLoop, fd);
+#endif
+}
+
+/* Queue the buffers to be sent on fd, they are copied. They go out with
+ * the next poll, after what was queued before. AE_ERR once a send failed. */
+int aeSend(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    if (!aeCompletion(eventLoop, fd)) return AE_ERR;
+#ifdef HAVE_IO_URING
+    return aeUringSendQueue(eventLoop, fd, iov, iovcnt) == -1 ? AE_ERR : AE_OK;
+#else
+    AE_NOTUSED(iov);
+    AE_NOTUSED(iovcnt);
+    return AE_ERR;
+#endif
+}
+
+/* Shut the write side of fd down once what is queued is sent. */
+int aeSendShutdown(aeEventLoop *eventLoop, int fd) {
+    if (!aeCompletion(eventLoop, fd)) return AE_ERR;
+#ifdef HAVE_IO_URING
+    return aeUringSendShutdown(eventLoop, fd) == -1 ? AE_ERR : AE_OK;
+#else
+    return AE_ERR;
+#endif
+}
+
+/* Bytes queued on fd and not sent yet. */
+size_t aeSendPending(aeEventLoop *eventLoop, int fd) {
+    if (!aeCompletion(eventLoop, fd)) return 0;
+#ifdef HAVE_IO_URING
+    return aeUringSendPending(eventLoop, fd);
+#else
+    return 0;
+#endif
+}
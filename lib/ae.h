@@ -34,6 +34,7 @@
 #define __AE_H__
 
 #include <time.h>
+#include <sys/uio.h>
 
 #define AE_OK 0
 #define AE_ERR -1
@@ -41,6 +42,9 @@
 #define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
+#define AE_EDGE 4       /* With AE_READABLE|AE_WRITABLE, report only the changes of
+                           readiness (EPOLLET), the proc has to read until EAGAIN.
+                           Ignored but by the epoll backend. */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -50,6 +54,17 @@
 #define AE_NOMORE -1
 #define AE_DELETED_EVENT_ID -1
 
+/* Time events are kept in a hierarchical timing wheel of AE_WHEEL_LEVELS
+ * levels of AE_WHEEL_SIZE slots, one millisecond per slot of the first
+ * level. Timers further than 2^24 milliseconds wait in an overflow list. */
+#define AE_WHEEL_BITS 6
+#define AE_WHEEL_SIZE (1<<AE_WHEEL_BITS)
+#define AE_WHEEL_LEVELS 4
+#define AE_WHEEL_EXPIRED (AE_WHEEL_LEVELS*AE_WHEEL_SIZE) /* due at the next processing */
+#define AE_WHEEL_DUE (AE_WHEEL_EXPIRED+1)                /* being processed */
+#define AE_WHEEL_OVERFLOW (AE_WHEEL_DUE+1)
+#define AE_WHEEL_LISTS (AE_WHEEL_OVERFLOW+1)
+
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
@@ -61,6 +76,14 @@ typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *client
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
+/* Completion events, io_uring only: the kernel does the I/O and the procs
+ * get its result. cfd is the accepted fd. buf holds the nread bytes received
+ * for the call only, nread is 0 at the end of the stream. err is 0 when all
+ * that aeSend() queued is sent. cfd, nread and err are -errno on error. */
+typedef void aeAcceptProc(struct aeEventLoop *eventLoop, int fd, int cfd, void *clientData);
+typedef void aeRecvProc(struct aeEventLoop *eventLoop, int fd, void *clientData, char *buf, int nread);
+typedef void aeSentProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int err);
+
 /* File event structure */
 typedef struct aeFileEvent {
     int mask; /* one of AE_(READABLE|WRITABLE) */
@@ -72,11 +95,12 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* milliseconds of the monotonic clock */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
+    int list; /* the list of the wheel it is linked in */
+    struct aeTimeEvent *prev;
     struct aeTimeEvent *next;
 } aeTimeEvent;
 
@@ -90,13 +114,23 @@ typedef struct aeFiredEvent {
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
-    long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    unsigned long long timeEventNextId; /* 31 bits, see aeCreateTimeEvent() */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    long long cachedTime; /* microseconds of the monotonic clock, see aeUpdateTime() */
+    long long timeNow; /* every millisecond before was processed */
+    aeTimeEvent *timeLists[AE_WHEEL_LISTS];
+    unsigned long long timeBits[AE_WHEEL_LEVELS]; /* the slots not empty */
+    int timeEvents;
+    aeTimeEvent **timeEventTable; /* by the low 32 bits of the ids */
+    int *timeEventFree;
+    int timeEventFreeCount;
+    int timeEventTableSize;
+    aeTimeEvent *timeEventRunning;
     int stop;
+    int flags; /* AE_DONT_WAIT: poll without sleeping, see aeSetDontWait() */
     void *apidata; /* This is used for polling API specific data */
+    int uring; /* the io_uring module in place of the default, see aeSetApi() */
     aeBeforeSleepProc *beforesleep;
 } aeEventLoop;
 
@@ -116,8 +150,21 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
+char *aeGetLoopApiName(aeEventLoop *eventLoop);
+int aeSetApi(aeEventLoop *eventLoop, const char *name);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
 int aeGetSetSize(aeEventLoop *eventLoop);
+void aeUpdateTime(aeEventLoop *eventLoop);
+long long aeGetTime(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+int aeCreateAcceptEvent(aeEventLoop *eventLoop, int fd, aeAcceptProc *proc, void *clientData);
+int aeCreateRecvEvent(aeEventLoop *eventLoop, int fd, aeRecvProc *proc,
+        aeSentProc *sentProc, void *clientData);
+void aeDeleteRecvEvent(aeEventLoop *eventLoop, int fd);
+void aeDeleteCompletionEvents(aeEventLoop *eventLoop, int fd);
+int aeSend(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt);
+int aeSendShutdown(aeEventLoop *eventLoop, int fd);
+size_t aeSendPending(aeEventLoop *eventLoop, int fd);
 
 #endif
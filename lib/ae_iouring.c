@@ -0,0 +1,799 @@
+/* Linux io_uring(7) based ae.c module, chosen at run time with aeSetApi().
+ *
+ * The readiness of the fds is watched with IORING_OP_POLL_ADD requests:
+ * one shot polls armed again after they fire for the level triggered
+ * events, multishot polls for AE_EDGE. Adding and removing events only
+ * queue requests, submitted together with the wait in one io_uring_enter()
+ * per iteration of the loop instead of one epoll_ctl() per change.
+ *
+ * The completion events let the kernel do the I/O itself: a multishot
+ * accept per listening socket, a multishot recv per connection into the
+ * buffers of a ring provided to the kernel, and the sends queued by
+ * aeSend() in an ae owned buffer per fd. What is queued during an iteration
+ * goes in one send, submitted with the wait, one in the kernel per fd.
+ *
+ * The ring is driven with the raw system calls, liburing is not needed. */
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define AE_URING_ENTRIES 4096
+#define AE_URING_IGNORE 0xffffffffffffffffULL /* user_data of the removals */
+#define AE_URING_BUFS 256           /* provided buffers of the recvs, a power of 2 */
+#define AE_URING_BUF_SIZE 16384
+#define AE_URING_BGID 0
+
+/* The user_data of a request: its type in the 2 high bits, then the
+ * generation and the fd, or the address of the send. */
+#define AE_URING_POLL 0ULL
+#define AE_URING_ACCEPT 1ULL
+#define AE_URING_RECV 2ULL
+#define AE_URING_SEND 3ULL
+#define AE_URING_GEN_MASK 0x3fffffffU
+#define AE_URING_TYPE(ud) ((ud) >> 62)
+#define AE_URING_GEN(ud) ((unsigned)((ud) >> 32) & AE_URING_GEN_MASK)
+#define AE_URING_FD(ud) ((int)((ud) & 0xffffffff))
+#define AE_URING_DATA(type, gen, fd) \
+    (((type) << 62) | ((unsigned long long)(gen) << 32) | (unsigned)(fd))
+
+/* Bytes to send on a fd, in the kernel or queued after the one which is. */
+typedef struct aeUringSend {
+    char *buf;
+    size_t len, off, cap;
+    int fd;
+    int orphan; /* the events of the fd were deleted, freed when it completes */
+    struct aeUringSend *prev, *next; /* in the list of the orphans */
+} aeUringSend;
+
+/* The completion events of a fd. */
+typedef struct aeUringFd {
+    unsigned cgen;       /* generation of the accept and recv, in user_data */
+    int accepting;       /* a multishot accept is in the kernel */
+    int recving;         /* a multishot recv is in the kernel */
+    aeAcceptProc *acceptProc;
+    aeRecvProc *recvProc;
+    aeSentProc *sentProc;
+    void *clientData;
+    aeUringSend *send;   /* in the kernel */
+    aeUringSend *out;    /* queued */
+    int err;             /* of a failed send, the next ones fail */
+    int dirty;           /* in the list of the fds to submit at the poll */
+    int rearm;           /* the accept or the recv could not be armed again */
+    int resend;          /* the send could not be submitted, not in the kernel */
+    int shut;            /* shutdown the write side once all is sent */
+} aeUringFd;
+
+typedef struct aeUringState {
+    int ringfd;
+    void *sq, *cq;
+    size_t sqsize, cqsize;
+    struct io_uring_sqe *sqes;
+    size_t sqessize;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;    /* requests not submitted yet */
+    int *armed;         /* mask of the poll in the kernel for each fd */
+    unsigned *gen;      /* generation of the poll of each fd, in user_data */
+    long long *seen;    /* iteration where the fd was last fired */
+    int *rearm;         /* one shot polls fired, to arm again */
+    int nrearm;
+    long long iteration;
+    struct io_uring_cqe *cqcopy; /* the completions out of the ring, to handle */
+    unsigned cqcap;
+    unsigned ncqcopy;
+    aeUringFd *fds;
+    int *dirty;         /* fds with requests to submit at the poll */
+    int ndirty;
+    aeUringSend *orphans;
+    struct io_uring_buf_ring *bufring;
+    char *bufs;
+    unsigned short buftail;
+} aeUringState;
+
+static int aeUringEnter(aeUringState *state, unsigned submit, unsigned wait,
+        unsigned flags, void *arg, size_t argsize) {
+    return (int)syscall(__NR_io_uring_enter, state->ringfd, submit, wait,
+            flags, arg, argsize);
+}
+
+static void aeUringSubmit(aeUringState *state) {
+    while (state->queued) {
+        int n = aeUringEnter(state, state->queued, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        state->queued -= n;
+    }
+}
+
+/* Move the completions out of their ring, they are handled by the next
+ * poll and aeUringProcess(). */
+static void aeUringReap(aeUringState *state) {
+    unsigned head = *state->cqhead;
+    unsigned tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+
+    if (state->ncqcopy + (tail - head) > state->cqcap) {
+        state->cqcap = (state->ncqcopy + (tail - head))*2;
+        state->cqcopy = zrealloc(state->cqcopy, sizeof(struct io_uring_cqe)*state->cqcap);
+    }
+    for (; head != tail; head++)
+        state->cqcopy[state->ncqcopy++] = state->cqes[head & *state->cqmask];
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/* Make room for n requests: the kernel consumes the queued ones. It takes
+ * none while the completions overflow their ring, EBUSY, which are reaped
+ * then. -1 with errno set when no room can be made. */
+static int aeUringReserve(aeUringState *state, unsigned n) {
+    while (*state->sqtail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) + n >
+           *state->sqmask + 1) {
+        unsigned queued = state->queued, ncqcopy = state->ncqcopy;
+
+        aeUringSubmit(state);
+        if (state->queued != queued) continue;
+        aeUringReap(state);
+        if (state->ncqcopy == ncqcopy) return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeUringState *state) {
+    unsigned tail = *state->sqtail;
+    struct io_uring_sqe *sqe;
+
+    if (aeUringReserve(state, 1) == -1) return NULL;
+    sqe = &state->sqes[tail & *state->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sqarray[tail & *state->sqmask] = tail & *state->sqmask;
+    __atomic_store_n(state->sqtail, tail + 1, __ATOMIC_RELEASE);
+    state->queued++;
+    return sqe;
+}
+
+static int aeUringPollAdd(aeUringState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & AE_READABLE) sqe->poll32_events |= POLLIN;
+    if (mask & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+    if (mask & AE_EDGE) sqe->len = IORING_POLL_ADD_MULTI;
+    state->gen[fd] = (state->gen[fd]+1) & AE_URING_GEN_MASK;
+    sqe->user_data = AE_URING_DATA(AE_URING_POLL, state->gen[fd], fd);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+static int aeUringPollRemove(aeUringState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = AE_URING_DATA(AE_URING_POLL, state->gen[fd], fd);
+    sqe->user_data = AE_URING_IGNORE;
+    state->armed[fd] = AE_NONE;
+    return 0;
+}
+
+/* Arm the poll of the fd for its mask, replacing the one armed before.
+ * The room for both is made first, on error the poll is left as it was. */
+static int aeUringArm(aeUringState *state, int fd, int mask) {
+    if (!(mask & (AE_READABLE|AE_WRITABLE))) mask = AE_NONE;
+    if (mask == state->armed[fd]) return 0;
+    if (aeUringReserve(state, 2) == -1) return -1;
+    if (state->armed[fd] != AE_NONE) aeUringPollRemove(state, fd);
+    if (mask != AE_NONE) aeUringPollAdd(state, fd, mask);
+    return 0;
+}
+
+static int aeUringCancel(aeUringState *state, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = AE_URING_IGNORE;
+    return 0;
+}
+
+static int aeUringAccept(aeUringState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+    sqe->user_data = AE_URING_DATA(AE_URING_ACCEPT, state->fds[fd].cgen, fd);
+    state->fds[fd].accepting = 1;
+    return 0;
+}
+
+static int aeUringRecv(aeUringState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BGID;
+    sqe->user_data = AE_URING_DATA(AE_URING_RECV, state->fds[fd].cgen, fd);
+    state->fds[fd].recving = 1;
+    return 0;
+}
+
+static int aeUringSendSubmit(aeUringState *state, aeUringSend *op) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = op->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(op->buf + op->off);
+    sqe->len = (unsigned)(op->len - op->off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (AE_URING_SEND << 62) | (uintptr_t)op;
+    return 0;
+}
+
+/* The fd has requests to submit at the next poll. */
+static void aeUringDirty(aeUringState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->ndirty++] = fd;
+}
+
+static void aeUringSendFree(aeUringSend *op) {
+    if (!op) return;
+    zfree(op->buf);
+    zfree(op);
+}
+
+/* Give a buffer back to the kernel for the recvs. */
+static void aeUringBufPut(aeUringState *state, int bid) {
+    struct io_uring_buf *buf = &state->bufring->bufs[state->buftail & (AE_URING_BUFS-1)];
+
+    /* the tail of the ring is in the resv of the first buffer, left as is */
+    buf->addr = (unsigned long long)(uintptr_t)(state->bufs + (size_t)bid*AE_URING_BUF_SIZE);
+    buf->len = AE_URING_BUF_SIZE;
+    buf->bid = bid;
+    state->buftail++;
+    __atomic_store_n(&state->bufring->tail, state->buftail, __ATOMIC_RELEASE);
+}
+
+/* The ring of the recv buffers, provided on the first recv, Linux 5.19. */
+static int aeUringBufSetup(aeUringState *state) {
+    struct io_uring_buf_reg reg;
+    int i;
+
+    if (state->bufring) return 0;
+    state->bufring = mmap(NULL, AE_URING_BUFS*sizeof(struct io_uring_buf),
+            PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->bufring == MAP_FAILED) {
+        state->bufring = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)state->bufring;
+    reg.ring_entries = AE_URING_BUFS;
+    reg.bgid = AE_URING_BGID;
+    if (syscall(__NR_io_uring_register, state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        munmap(state->bufring, AE_URING_BUFS*sizeof(struct io_uring_buf));
+        state->bufring = NULL;
+        return -1;
+    }
+    state->bufs = zmalloc((size_t)AE_URING_BUFS*AE_URING_BUF_SIZE);
+    for (i = 0; i < AE_URING_BUFS; i++)
+        aeUringBufPut(state, i);
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->apidata;
+    int i;
+
+    if (state->sqes) munmap(state->sqes, state->sqessize);
+    if (state->cq && state->cq != state->sq) munmap(state->cq, state->cqsize);
+    if (state->sq) munmap(state->sq, state->sqsize);
+    /* the requests in the kernel go with the ring, their buffers after */
+    if (state->ringfd != -1) close(state->ringfd);
+    if (state->bufring) munmap(state->bufring, AE_URING_BUFS*sizeof(struct io_uring_buf));
+    zfree(state->bufs);
+    for (i = 0; i < eventLoop->setsize; i++) {
+        aeUringSendFree(state->fds[i].send);
+        aeUringSendFree(state->fds[i].out);
+    }
+    while (state->orphans) {
+        aeUringSend *op = state->orphans;
+        state->orphans = op->next;
+        aeUringSendFree(op);
+    }
+    zfree(state->fds);
+    zfree(state->dirty);
+    zfree(state->cqcopy);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->seen);
+    zfree(state->rearm);
+    zfree(state);
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize) {
+    aeUringState *state = eventLoop->apidata;
+    int i;
+
+    state->armed = zrealloc(state->armed, sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen, sizeof(unsigned)*setsize);
+    state->seen = zrealloc(state->seen, sizeof(long long)*setsize);
+    state->rearm = zrealloc(state->rearm, sizeof(int)*setsize);
+    state->fds = zrealloc(state->fds, sizeof(aeUringFd)*setsize);
+    state->dirty = zrealloc(state->dirty, sizeof(int)*setsize);
+    for (i = eventLoop->setsize; i < setsize; i++) {
+        state->armed[i] = AE_NONE;
+        state->gen[i] = 0;
+        state->seen[i] = 0;
+        memset(&state->fds[i], 0, sizeof(aeUringFd));
+    }
+    return 0;
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    aeUringState *state = zmalloc(sizeof(aeUringState));
+    struct io_uring_params p;
+    int setsize = eventLoop->setsize;
+
+    if (!state) return -1;
+    memset(state, 0, sizeof(*state));
+    state->ringfd = -1;
+    eventLoop->apidata = state;
+    /* the fd arrays are grown from an empty set */
+    eventLoop->setsize = 0;
+    aeUringResize(eventLoop, setsize);
+    eventLoop->setsize = setsize;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    state->ringfd = (int)syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p);
+    if (state->ringfd == -1 && errno == EINVAL) {
+        /* COOP_TASKRUN is only an optimization, older kernels lack it */
+        memset(&p, 0, sizeof(p));
+        state->ringfd = (int)syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p);
+    }
+    if (state->ringfd == -1) goto err;
+    /* The wait with a timeout needs IORING_ENTER_EXT_ARG, Linux 5.11. */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    state->sqsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqsize > state->sqsize) state->sqsize = state->cqsize;
+        state->cqsize = state->sqsize;
+    }
+    state->sq = mmap(NULL, state->sqsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sq == MAP_FAILED) {
+        state->sq = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq = state->sq;
+    } else {
+        state->cq = mmap(NULL, state->cqsize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cq == MAP_FAILED) {
+            state->cq = NULL;
+            goto err;
+        }
+    }
+    state->sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sqhead = (unsigned *)((char *)state->sq + p.sq_off.head);
+    state->sqtail = (unsigned *)((char *)state->sq + p.sq_off.tail);
+    state->sqmask = (unsigned *)((char *)state->sq + p.sq_off.ring_mask);
+    state->sqarray = (unsigned *)((char *)state->sq + p.sq_off.array);
+    state->cqhead = (unsigned *)((char *)state->cq + p.cq_off.head);
+    state->cqtail = (unsigned *)((char *)state->cq + p.cq_off.tail);
+    state->cqmask = (unsigned *)((char *)state->cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cq + p.cq_off.cqes);
+    state->cqcap = p.cq_entries;
+    state->cqcopy = zmalloc(sizeof(struct io_uring_cqe)*p.cq_entries);
+    return 0;
+
+err:
+    aeUringFree(eventLoop);
+    eventLoop->apidata = NULL;
+    return -1;
+}
+
+static int aeUringAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    return aeUringArm(eventLoop->apidata, fd, eventLoop->events[fd].mask | mask);
+}
+
+/* When the poll cannot be replaced the one armed stays, the events of the
+ * mask deleted are not called by ae.c. */
+static void aeUringDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeUringArm(eventLoop->apidata, fd, eventLoop->events[fd].mask & ~delmask);
+}
+
+static int aeUringAcceptAdd(aeEventLoop *eventLoop, int fd, aeAcceptProc *proc, void *clientData) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+
+    if (!f->accepting && aeUringAccept(state, fd) == -1) return -1;
+    f->acceptProc = proc;
+    f->clientData = clientData;
+    return 0;
+}
+
+static int aeUringRecvAdd(aeEventLoop *eventLoop, int fd, aeRecvProc *proc,
+        aeSentProc *sentProc, void *clientData)
+{
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+
+    if (aeUringBufSetup(state) == -1) return -1;
+    if (!f->recving && aeUringRecv(state, fd) == -1) return -1;
+    f->recvProc = proc;
+    f->sentProc = sentProc;
+    f->clientData = clientData;
+    return 0;
+}
+
+/* Stop the accept or the recv of the fd, the completions still on their
+ * way are told apart by the generation. Those of a multishot which could
+ * not be cancelled cancel it again, see aeUringStale(). */
+static void aeUringRecvDel(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+
+    if (f->accepting) aeUringCancel(state, AE_URING_DATA(AE_URING_ACCEPT, f->cgen, fd));
+    if (f->recving) aeUringCancel(state, AE_URING_DATA(AE_URING_RECV, f->cgen, fd));
+    f->cgen = (f->cgen+1) & AE_URING_GEN_MASK;
+    f->accepting = f->recving = f->rearm = 0;
+    f->acceptProc = NULL;
+    f->recvProc = NULL;
+}
+
+/* Before the fd is closed: the send in the kernel is cancelled, its buffer
+ * freed when it completes, the bytes queued are dropped. */
+static void aeUringCompletionDel(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+    aeUringSend *op = f->send;
+
+    aeUringRecvDel(eventLoop, fd);
+    if (op && f->resend) {
+        aeUringSendFree(op);
+    } else if (op) {
+        op->orphan = 1;
+        op->prev = NULL;
+        op->next = state->orphans;
+        if (op->next) op->next->prev = op;
+        state->orphans = op;
+        aeUringCancel(state, (AE_URING_SEND << 62) | (uintptr_t)op);
+    }
+    aeUringSendFree(f->out);
+    f->send = f->out = NULL;
+    f->sentProc = NULL;
+    f->clientData = NULL;
+    f->err = f->resend = f->shut = 0;
+}
+
+static int aeUringSendQueue(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+    aeUringSend *op = f->out;
+    size_t n = 0;
+    int i;
+
+    if (f->err) {
+        errno = -f->err;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) n += iov[i].iov_len;
+    if (!op) {
+        op = f->out = zmalloc(sizeof(*op));
+        memset(op, 0, sizeof(*op));
+        op->fd = fd;
+    }
+    if (op->len + n > op->cap) {
+        op->cap = op->len + n > op->cap*2 ? op->len + n : op->cap*2;
+        op->buf = zrealloc(op->buf, op->cap);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(op->buf + op->len, iov[i].iov_base, iov[i].iov_len);
+        op->len += iov[i].iov_len;
+    }
+    aeUringDirty(state, fd);
+    return 0;
+}
+
+static int aeUringSendShutdown(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+
+    if (f->send || (f->out && f->out->len)) {
+        f->shut = 1;
+        return 0;
+    }
+    return shutdown(fd, SHUT_WR);
+}
+
+static size_t aeUringSendPending(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringFd *f = &state->fds[fd];
+
+    return (f->send ? f->send->len - f->send->off : 0) + (f->out ? f->out->len : 0);
+}
+
+/* A completion of a multishot cancelled since: it is cancelled again in
+ * case the cancel could not be submitted. */
+static void aeUringStale(aeUringState *state, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_MORE) aeUringCancel(state, cqe->user_data);
+}
+
+/* The accept or the recv could not be armed again, it is at the poll. */
+static void aeUringRearm(aeUringState *state, int fd) {
+    state->fds[fd].rearm = 1;
+    aeUringDirty(state, fd);
+}
+
+static void aeUringAccepted(aeEventLoop *eventLoop, struct io_uring_cqe *cqe) {
+    aeUringState *state = eventLoop->apidata;
+    int fd = AE_URING_FD(cqe->user_data);
+    unsigned cgen = AE_URING_GEN(cqe->user_data);
+    aeUringFd *f = &state->fds[fd];
+
+    if (f->cgen != cgen || !f->accepting) {
+        /* accepted before the cancel, nobody takes it */
+        if (cqe->res >= 0) close(cqe->res);
+        aeUringStale(state, cqe);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) f->accepting = 0;
+    f->acceptProc(eventLoop, fd, cqe->res, f->clientData);
+    if (f->cgen == cgen && f->acceptProc && !f->accepting &&
+        aeUringAccept(state, fd) == -1)
+        aeUringRearm(state, fd);
+}
+
+static void aeUringReceived(aeEventLoop *eventLoop, struct io_uring_cqe *cqe) {
+    aeUringState *state = eventLoop->apidata;
+    int fd = AE_URING_FD(cqe->user_data);
+    unsigned cgen = AE_URING_GEN(cqe->user_data);
+    aeUringFd *f = &state->fds[fd];
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (f->cgen == cgen && f->recving) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) f->recving = 0;
+        if (cqe->res > 0 && bid >= 0)
+            f->recvProc(eventLoop, fd, f->clientData,
+                    state->bufs + (size_t)bid*AE_URING_BUF_SIZE, cqe->res);
+        else if (cqe->res != -ENOBUFS)
+            f->recvProc(eventLoop, fd, f->clientData, NULL, cqe->res);
+        /* out of buffers the recv stops, it goes on with those given back */
+        if ((cqe->res > 0 || cqe->res == -ENOBUFS) &&
+            f->cgen == cgen && f->recvProc && !f->recving &&
+            aeUringRecv(state, fd) == -1)
+            aeUringRearm(state, fd);
+    } else {
+        aeUringStale(state, cqe);
+    }
+    if (bid >= 0) aeUringBufPut(state, bid);
+}
+
+static void aeUringSent(aeEventLoop *eventLoop, struct io_uring_cqe *cqe) {
+    aeUringState *state = eventLoop->apidata;
+    aeUringSend *op = (aeUringSend *)(uintptr_t)(cqe->user_data & ~(AE_URING_SEND << 62));
+    aeUringFd *f;
+    int fd = op->fd;
+
+    if (op->orphan) {
+        if (op->prev) op->prev->next = op->next;
+        else state->orphans = op->next;
+        if (op->next) op->next->prev = op->prev;
+        aeUringSendFree(op);
+        return;
+    }
+    f = &state->fds[fd];
+    if (cqe->res > 0) {
+        op->off += cqe->res;
+        /* a short send, the rest goes before what was queued since */
+        if (op->off < op->len) {
+            if (aeUringSendSubmit(state, op) == -1) {
+                f->resend = 1;
+                aeUringDirty(state, fd);
+            }
+            return;
+        }
+    } else {
+        f->err = cqe->res ? cqe->res : -EPIPE;
+    }
+    op->len = op->off = 0;
+    if (f->err) {
+        aeUringSendFree(op);
+        f->send = NULL;
+        if (f->out) f->out->len = 0;
+        if (f->sentProc) f->sentProc(eventLoop, fd, f->clientData, f->err);
+        return;
+    }
+    if (f->out && f->out->len) {
+        /* the buffer which was sent takes what is queued next */
+        f->send = f->out;
+        f->out = op;
+        if (aeUringSendSubmit(state, f->send) == -1) {
+            f->resend = 1;
+            aeUringDirty(state, fd);
+        }
+        return;
+    }
+    f->send = NULL;
+    if (!f->out) f->out = op;
+    else aeUringSendFree(op);
+    if (f->shut) {
+        f->shut = 0;
+        shutdown(fd, SHUT_WR);
+    }
+    if (f->sentProc) f->sentProc(eventLoop, fd, f->clientData, 0);
+}
+
+/* Submit what the fd has: the send queued, or one which could not be
+ * submitted, the accept or the recv to arm again. -1 to try again at the
+ * next poll. */
+static int aeUringFlush(aeUringState *state, int fd) {
+    aeUringFd *f = &state->fds[fd];
+
+    if (f->rearm) {
+        if (f->acceptProc && !f->accepting && aeUringAccept(state, fd) == -1) return -1;
+        if (f->recvProc && !f->recving && aeUringRecv(state, fd) == -1) return -1;
+        f->rearm = 0;
+    }
+    if (f->resend) {
+        if (aeUringSendSubmit(state, f->send) == -1) return -1;
+        f->resend = 0;
+    } else if (!f->send && f->out && f->out->len) {
+        if (aeUringSendSubmit(state, f->out) == -1) return -1;
+        f->send = f->out;
+        f->out = NULL;
+    }
+    return 0;
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeUringState *state = eventLoop->apidata;
+    unsigned head, i, n;
+    int j, k, wait, numevents = 0;
+
+    /* The one shot polls which fired are armed again, they complete at
+     * once for the fds still ready: the events are level triggered. */
+    for (j = 0, k = 0; j < state->nrearm; j++) {
+        int fd = state->rearm[j];
+        if (state->armed[fd] == AE_NONE &&
+            aeUringArm(state, fd, eventLoop->events[fd].mask) == -1)
+            state->rearm[k++] = fd;
+    }
+    state->nrearm = k;
+    /* What was queued by the iteration, one send per fd. */
+    for (j = 0, k = 0; j < state->ndirty; j++) {
+        int fd = state->dirty[j];
+
+        if (aeUringFlush(state, fd) == -1) state->dirty[k++] = fd;
+        else state->fds[fd].dirty = 0;
+    }
+    state->ndirty = k;
+    state->iteration++;
+
+    /* No wait with completions to handle or requests left to submit. */
+    wait = !(tvp && !tvp->tv_sec && !tvp->tv_usec) && !state->ncqcopy &&
+        !state->nrearm && !state->ndirty;
+    head = *state->cqhead;
+    if (head != __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE)) {
+        aeUringSubmit(state);
+    } else {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        int r;
+
+        /* Without waiting the kernel is still entered for the completions:
+         * with COOP_TASKRUN they are only posted then. */
+        memset(&arg, 0, sizeof(arg));
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+        r = aeUringEnter(state, state->queued, wait,
+                IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (r > 0) state->queued -= r;
+    }
+
+    /* Copied out: the completion procs, run after, queue new requests
+     * which may enter the kernel and fill the ring again. The polls are
+     * handled here, the others are left to aeUringProcess(). */
+    aeUringReap(state);
+    for (i = 0, n = 0; i < state->ncqcopy; i++) {
+        struct io_uring_cqe *cqe = &state->cqcopy[i];
+        int fd = AE_URING_FD(cqe->user_data);
+        int mask = 0;
+
+        if (cqe->user_data == AE_URING_IGNORE) continue;
+        if (AE_URING_TYPE(cqe->user_data) != AE_URING_POLL) {
+            state->cqcopy[n++] = *cqe;
+            continue;
+        }
+        /* polls replaced or removed since */
+        if (AE_URING_GEN(cqe->user_data) != state->gen[fd] ||
+            state->armed[fd] == AE_NONE) continue;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            state->armed[fd] = AE_NONE;
+            if (cqe->res >= 0) state->rearm[state->nrearm++] = fd;
+        }
+        if (cqe->res < 0) {
+            mask = AE_READABLE|AE_WRITABLE;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        /* a multishot poll may complete more than once per iteration */
+        if (state->seen[fd] == state->iteration) {
+            for (j = numevents-1; eventLoop->fired[j].fd != fd; j--);
+            eventLoop->fired[j].mask |= mask;
+            continue;
+        }
+        state->seen[fd] = state->iteration;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    state->ncqcopy = n;
+    return numevents;
+}
+
+/* Call the procs of the completion events, in order. Those reaped while
+ * they run are handled too, the polls among them are left to the next
+ * poll. */
+static int aeUringProcess(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->apidata;
+    unsigned i, n;
+    int processed = 0;
+
+    for (i = 0, n = 0; i < state->ncqcopy; i++) {
+        /* a copy, the procs may grow the array */
+        struct io_uring_cqe cqe = state->cqcopy[i];
+
+        if (cqe.user_data == AE_URING_IGNORE) continue;
+        switch (AE_URING_TYPE(cqe.user_data)) {
+        case AE_URING_ACCEPT: aeUringAccepted(eventLoop, &cqe); break;
+        case AE_URING_RECV: aeUringReceived(eventLoop, &cqe); break;
+        case AE_URING_SEND: aeUringSent(eventLoop, &cqe); break;
+        default: state->cqcopy[n++] = cqe; continue;
+        }
+        processed++;
+    }
+    state->ncqcopy = n;
+    return processed;
+}
+
+static char *aeUringName(void) {
+    return "io_uring";
+}
@@ -1,5 +1,5 @@
 /*
- * libws.h -- tiny websocket library, need openssl.
+ * libws.h -- tiny websocket library.
  *
  * Copyright (c) zhoukk <izhoukk@gmail.com>
  *
@@ -69,6 +69,7 @@ extern "C" {
 #define WS_SECRET_LEN       36
 
 #define WS_MASK             13
+#define WS_FRAME_HEADER_MAX 14
 #define WS_SECRET           "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
 
@@ -83,7 +84,10 @@ extern "C" {
 /** Websocket frame flag.*/
 #define WS_FLAG_FIN             0x10
 #define WS_FLAG_MASK            0x20
+#define WS_FLAG_RSV1            0x40
 
+/** The longest payload of a control frame. */
+#define WS_CONTROL_MAX          125
 
 /** Websocket close frame status. */
 #define WS_STATUS_NORMAL                1000
@@ -106,6 +110,7 @@ extern "C" {
 #define WS_HEADER_KEY               0x08
 #define WS_HEADER_ACCEPT            0x10
 #define WS_HEADER_PROTOCOL          0x20
+#define WS_HEADER_EXTENSIONS        0x40
 
 #define WS_HEADER_REQ           (WS_HEADER_VERSION | \
                                  WS_HEADER_UPGRADE | \
@@ -134,24 +139,70 @@ extern "C" {
                              (((ll) & 0x000000000000ff00) << 40) | \
                              (((ll) << 56)))
 
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+# define WS_NTOH16(s)       (s)
+# define WS_NTOH64(ll)      (ll)
+#elif defined(__GNUC__)
+# define WS_NTOH16(s)       __builtin_bswap16(s)
+# define WS_NTOH64(ll)      __builtin_bswap64(ll)
+#else
+# define WS_NTOH16(s)       WS_SWAP16(s)
+# define WS_NTOH64(ll)      WS_SWAP64(ll)
+#endif
+
 #define WS_BUILD_OPCODE(flags, op)  (flags |= op)
 #define WS_BUILD_FIN(flags)         (flags |= WS_FLAG_FIN)
 #define WS_BUILD_MASK(flags)        (flags |= WS_FLAG_MASK)
+#define WS_BUILD_RSV1(flags)        (flags |= WS_FLAG_RSV1)
 
 struct libws_b {
     char *data;
     uint64_t length;
 };
 
+/**
+ * memory allocator for frame payloads and sessions, ud is passed back to every call.
+ * a null allocator means malloc, realloc and free.
+ */
+struct libws_allocator {
+    void *(*alloc)(void *ud, size_t size);
+    void *(*realloc)(void *ud, void *ptr, size_t size);
+    void (*free)(void *ud, void *ptr);
+    void *ud;
+};
+
+/** Websocket frame parser mode. */
+#define WS_PARSER_INPLACE       0x01
+#define WS_PARSER_STREAM        0x02
+#define WS_PARSER_UTF8          0x04
+#define WS_PARSER_RSV1          0x08
+
+/** UTF-8 validation state, anything else is inside a sequence. */
+#define WS_UTF8_ACCEPT          0
+#define WS_UTF8_REJECT          1
+
 struct libws_frame {
     int opcode;
     int fin;
     int mask;
+    int rsv1;       /* compressed by permessage-deflate */
+    int owned;      /* payload is malloced and must be freed by the caller */
     struct libws_b payload;
+    uint64_t offset;    /* streaming, offset of this chunk in the frame payload */
+    uint64_t remain;    /* streaming, payload bytes of the frame after this chunk */
+};
+
+/** permessage-deflate parameters, see RFC 7692. window bits are 8 to 15, 0 means 15. */
+struct libws_deflate {
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    int server_max_window_bits;
+    int client_max_window_bits;
 };
 
 struct libws_parser {
     int state;
+    int mode;
     uint64_t require;
 
     char mask[4];
@@ -159,6 +210,13 @@ struct libws_parser {
     uint64_t mask_offset;
     uint64_t offset;
     uint64_t length;
+    char *data;
+    const struct libws_allocator *a;
+    uint64_t max_length;
+    int error;
+    int text;           /* a text message is in progress */
+    uint32_t utf8;      /* validation state of the text message */
+    char control[WS_CONTROL_MAX];   /* payload of a control frame, never allocated */
 };
 
 /**
@@ -174,35 +232,158 @@ extern LIBWS_API uint64_t libws__build_size(int mask, uint64_t length);
  *      opcode - WS_BUILD_OPCODE()
  *         fin - WS_BUILD_FIN()
  *        mask - WS_BUILD_MASK()
+ *        rsv1 - WS_BUILD_RSV1(), the payload is compressed by permessage-deflate
  */
 extern LIBWS_API void libws__build(char *data, int flags, struct libws_b *payload);
 
+/**
+ * build only the 2 to 14 bytes header of a frame with length payload into head,
+ * so the payload can be sent after it without a copy, e.g. with writev().
+ * flags are the same as libws__build(), with WS_FLAG_MASK the mask key is the last
+ * 4 bytes of the header and the payload must be masked with it before sending.
+ *
+ * return the header size
+ */
+extern LIBWS_API int libws__build_header(char head[WS_FRAME_HEADER_MAX], int flags, uint64_t length);
+
+/**
+ * xor length bytes of payload with the 4 bytes mask, starting at mask[offset % 4],
+ * into buff. buff may be the same as payload to unmask in place.
+ *
+ * return the mask offset for the next byte
+ */
+extern LIBWS_API uint64_t libws__mask(char *buff, const char mask[4], const char *payload, uint64_t length, uint64_t offset);
+
+/**
+ * same as libws__mask(), and validate the unmasked bytes as UTF-8 in the same pass.
+ * *state starts with WS_UTF8_ACCEPT and carries a sequence split across calls,
+ * it is WS_UTF8_REJECT on invalid UTF-8, the bytes after the error may be left masked,
+ * and must be WS_UTF8_ACCEPT at the end of a text.
+ *
+ * return the mask offset for the next byte
+ */
+extern LIBWS_API uint64_t libws__mask_utf8(char *buff, const char mask[4], const char *payload, uint64_t length,
+                                           uint64_t offset, uint32_t *state);
+
+/**
+ * name of the masking kernel selected for this cpu: "avx2", "sse2" or "word"
+ */
+extern LIBWS_API const char *libws__mask_impl(void);
+
 /**
  * initialize a websocket frame parser
  */
 extern LIBWS_API void libws__parser_init(struct libws_parser *p);
 
+/**
+ * set the parser mode
+ *
+ * mode:
+ *      WS_PARSER_INPLACE - when a whole frame is in b, unmask the payload in place
+ *                          and point the frame payload into b instead of a malloced copy.
+ *                          the payload is valid as long as the caller's buffer.
+ *       WS_PARSER_STREAM - deliver data frame payloads in chunks as they arrive, unmasked in place
+ *                          in b, without buffering. every chunk carries its offset in the frame
+ *                          and the remaining length, the last chunk of a frame has remain == 0.
+ *                          a zero length frame is one empty chunk. control frames are whole.
+ *         WS_PARSER_UTF8 - validate text messages as UTF-8 while unmasking, across fragments and reads.
+ *                          invalid UTF-8 fails with error WS_STATUS_INVALID_PAYLOAD.
+ *                          compressed messages are left to be validated once inflated.
+ *         WS_PARSER_RSV1 - accept RSV1 on the first frame of a data message, set when permessage-deflate
+ *                          is negotiated. else RSV1, like RSV2 and RSV3, fails with WS_STATUS_PROTOCOL_ERROR.
+ */
+extern LIBWS_API void libws__parser_mode(struct libws_parser *p, int mode);
+
+/**
+ * allocate, reallocate and free with allocator a, or with libc when a is null
+ */
+extern LIBWS_API void *libws__alloc(const struct libws_allocator *a, size_t size);
+extern LIBWS_API void *libws__realloc(const struct libws_allocator *a, void *ptr, size_t size);
+extern LIBWS_API void libws__free(const struct libws_allocator *a, void *ptr);
+
+/**
+ * limit the payload length of data frames, 0 means no limit.
+ * a longer frame fails before anything is allocated, with error WS_STATUS_MESSAGE_TOO_BIG.
+ * control frames are always limited to 125 bytes.
+ */
+extern LIBWS_API void libws__parser_limit(struct libws_parser *p, uint64_t max_length);
+
+/**
+ * set the allocator of frame payloads, must be called before parsing
+ */
+extern LIBWS_API void libws__parser_allocator(struct libws_parser *p, const struct libws_allocator *a);
+
+/**
+ * free the frame payload when it is owned, with the parser allocator
+ */
+extern LIBWS_API void libws__frame_free(struct libws_parser *p, struct libws_frame *f);
+
+/**
+ * free the payload of a frame in progress, the parser can be initialized again
+ */
+extern LIBWS_API void libws__parser_free(struct libws_parser *p);
+
 /**
  * parse a websocket frame from b
+ * the frame payload must be freed by libws__frame_free() when f->owned is set.
+ * a control frame which is not delivered in place is in p->control until the next call.
  *
  * return:
- *      -1 - parse error
+ *      -1 - parse error, p->error is the websocket close status
  *       0 - parse finish, need more data
  *       1 - a websocket frame parsed
  */
 extern LIBWS_API int libws__parser_execute(struct libws_parser *p, struct libws_b *b, struct libws_frame *f);
 
+/**
+ * parse every frame of b into frames, at most n, in one pass.
+ * complete frames are decoded straight from b, see WS_PARSER_INPLACE to keep their payloads in b,
+ * and a frame split at the end of b is buffered by the parser like libws__parser_execute().
+ * b is advanced past the parsed bytes, it still holds data when frames is full
+ * or after a control frame in p->control.
+ *
+ * return:
+ *      -1 - parse error before any frame, p->error is the websocket close status
+ *      >=0 - number of frames parsed, an error after them is returned by the next call
+ */
+extern LIBWS_API int libws__parser_execute_many(struct libws_parser *p, struct libws_b *b, struct libws_frame *frames, int n);
+
 /**
  * initialize a websocket request
  */
 extern LIBWS_API int libws__request(char *request, size_t len, const char *url, const char *host, const char *origin,
-                                    const char *protocol, char key[WS_KEY_LEN]);
+                                    const char *protocol, const char *extensions, char key[WS_KEY_LEN]);
 
 /**
  * response a websocket resquest
+ * a null extensions leaves the Sec-WebSocket-Extensions header out, the same for request.
+ * a null or empty protocol leaves the Sec-WebSocket-Protocol header out.
  */
 extern LIBWS_API int libws__response(char *response, size_t len, const char *server, const char *protocol,
-                                     const char key[WS_KEY_LEN], char accept[WS_ACCEPT_LEN]);
+                                     const char *extensions, const char key[WS_KEY_LEN], char accept[WS_ACCEPT_LEN]);
+
+/**
+ * response with an accept already generated, as by libws__generate_accept_many()
+ */
+extern LIBWS_API int libws__response_accept(char *response, size_t len, const char *server, const char *protocol,
+                                            const char *extensions, const char accept[WS_ACCEPT_LEN]);
+
+/**
+ * format permessage-deflate parameters d as a Sec-WebSocket-Extensions value into buff,
+ * as the offer of a client when offer is set, else as the response of a server.
+ * return the length, as snprintf()
+ */
+extern LIBWS_API int libws__deflate_format(char *buff, size_t len, const struct libws_deflate *d, int offer);
+
+/**
+ * negotiate permessage-deflate from a Sec-WebSocket-Extensions value into d.
+ * a server accepts the first offer which fits its parameters want,
+ * a client checks the response of the server against its offer want.
+ * a window of 8 bits is never agreed for the local compressor, zlib only deflates with 9 or more.
+ * return 0 when agreed, -1 when there is no acceptable permessage-deflate
+ */
+extern LIBWS_API int libws__deflate_negotiate(struct libws_deflate *d, const struct libws_deflate *want, int issrv,
+                                              const char *value, size_t len);
 
 /**
  * check http request and response header for websocket
@@ -221,6 +402,22 @@ extern LIBWS_API void libws__generate_key(char key[WS_KEY_LEN]);
  */
 extern LIBWS_API void libws__generate_accept(char accept[WS_ACCEPT_LEN], const char key[WS_KEY_LEN]);
 
+/**
+ * accept[i] of key[i] for n keys, hashed together in the lanes of the widest SIMD registers
+ */
+extern LIBWS_API void libws__generate_accept_many(char *accept[], const char *key[], int n);
+
+/**
+ * name of the SHA-1 kernel selected for this cpu: "sha-ni" or "scalar"
+ */
+extern LIBWS_API const char *libws__sha1_impl(void);
+
+/**
+ * name of the kernel of libws__generate_accept_many() for this cpu, with the
+ * number of keys it hashes at once: "avx512" 16, "avx2" 8, "sse2" 4 or one by one
+ */
+extern LIBWS_API const char *libws__sha1_many_impl(int *lanes);
+
 /**
  * check accept and key when handshake
  */
@@ -238,13 +435,22 @@ extern LIBWS_API int libws__handshake(const char key[WS_KEY_LEN], const char acc
  * Implement
  */
 
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <assert.h>
 #include <ctype.h>
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+# define LIBWS_X86 1
+# include <immintrin.h>
+#endif
+
+
+/* RSV2 or RSV3, never valid without an extension which uses them */
+#define WS_FLAG_RSV23           0x80
 
 enum libws_state {
     s_start = 0,
@@ -255,6 +461,23 @@ enum libws_state {
 };
 
 
+void *
+libws__alloc(const struct libws_allocator *a, size_t size) {
+    return a ? a->alloc(a->ud, size) : malloc(size);
+}
+
+void *
+libws__realloc(const struct libws_allocator *a, void *ptr, size_t size) {
+    return a ? a->realloc(a->ud, ptr, size) : realloc(ptr, size);
+}
+
+void
+libws__free(const struct libws_allocator *a, void *ptr) {
+    if (!ptr) return;
+    if (a) a->free(a->ud, ptr);
+    else free(ptr);
+}
+
 static const unsigned char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 static char *
@@ -277,12 +500,376 @@ strncasestr(const char *haystack, const char *needle, size_t len) {
     return (char *)haystack;
 }
 
-static uint64_t
-frame_mask(char *buff, char mask[4], const char *payload, uint64_t length, uint64_t offset) {
+/**
+ * masking kernels, key is the mask already rotated to the first byte,
+ * in memory order. every kernel xor 8 bytes or more at a time and leaves
+ * the tail to mask_word, whose phase stays the same on a multiple of 4.
+ */
+typedef void (*libws_mask_fn)(char *buff, const char *payload, uint64_t length, uint32_t key);
+
+static void
+mask_word(char *buff, const char *payload, uint64_t length, uint32_t key) {
+    uint64_t i, w, k;
+    const char *m = (const char *)&key;
+
+    k = ((uint64_t)key << 32) | key;
+    for (i = 0; i + 8 <= length; i += 8) {
+        memcpy(&w, payload + i, 8);
+        w ^= k;
+        memcpy(buff + i, &w, 8);
+    }
+    for (; i < length; i++)
+        buff[i] = payload[i] ^ m[i & 3];
+}
+
+#ifdef LIBWS_X86
+static void
+mask_sse2(char *buff, const char *payload, uint64_t length, uint32_t key) {
+    uint64_t i = 0;
+    __m128i k = _mm_set1_epi32((int)key);
+
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(payload + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(payload + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(payload + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(payload + i + 48));
+        _mm_storeu_si128((__m128i *)(buff + i), _mm_xor_si128(a, k));
+        _mm_storeu_si128((__m128i *)(buff + i + 16), _mm_xor_si128(b, k));
+        _mm_storeu_si128((__m128i *)(buff + i + 32), _mm_xor_si128(c, k));
+        _mm_storeu_si128((__m128i *)(buff + i + 48), _mm_xor_si128(d, k));
+    }
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(payload + i));
+        _mm_storeu_si128((__m128i *)(buff + i), _mm_xor_si128(a, k));
+    }
+    mask_word(buff + i, payload + i, length - i, key);
+}
+
+__attribute__((target("avx2"))) static void
+mask_avx2(char *buff, const char *payload, uint64_t length, uint32_t key) {
+    uint64_t i, head;
+    __m256i k;
+
+    /* align the stores on long payloads, the key rotates with the head bytes */
+    head = length >= 256 ? (32 - ((uintptr_t)buff & 31)) & 31 : 0;
+    mask_word(buff, payload, head, key);
+    key = (head & 3) ? (key >> (8 * (head & 3))) | (key << (32 - 8 * (head & 3))) : key;
+    buff += head;
+    payload += head;
+    length -= head;
+
+    k = _mm256_set1_epi32((int)key);
+    for (i = 0; i + 128 <= length; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(payload + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(payload + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(payload + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(payload + i + 96));
+        _mm256_storeu_si256((__m256i *)(buff + i), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *)(buff + i + 32), _mm256_xor_si256(b, k));
+        _mm256_storeu_si256((__m256i *)(buff + i + 64), _mm256_xor_si256(c, k));
+        _mm256_storeu_si256((__m256i *)(buff + i + 96), _mm256_xor_si256(d, k));
+    }
+    for (; i + 32 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(payload + i));
+        _mm256_storeu_si256((__m256i *)(buff + i), _mm256_xor_si256(a, k));
+    }
+    /* leave no dirty upper state to the sse code of the tail */
+    _mm256_zeroupper();
+    mask_word(buff + i, payload + i, length - i, key);
+}
+#endif
+
+/**
+ * UTF-8 validation, a state is the count of continuation bytes still expected
+ * with the range of the next one, so overlongs, surrogates and code points
+ * over U+10FFFF are rejected on their second byte.
+ */
+#define UTF8_STATE(need, lo, hi)    (((uint32_t)(need) << 16) | ((hi) << 8) | (lo))
+
+static uint32_t
+utf8_run(uint32_t state, const unsigned char *s, uint64_t length) {
     uint64_t i;
-    for (i = 0; i < length; i++)
-        buff[i] = payload[i] ^ mask[(i + offset) % 4];
-    return ((i + offset) % 4);
+    unsigned c;
+
+    for (i = 0; i < length; i++) {
+        c = s[i];
+        if (state == WS_UTF8_ACCEPT) {
+            if (c < 0x80) continue;
+            if (c < 0xc2 || c > 0xf4) return WS_UTF8_REJECT;
+            if (c < 0xe0) state = UTF8_STATE(1, 0x80, 0xbf);
+            else if (c == 0xe0) state = UTF8_STATE(2, 0xa0, 0xbf);
+            else if (c == 0xed) state = UTF8_STATE(2, 0x80, 0x9f);
+            else if (c < 0xf0) state = UTF8_STATE(2, 0x80, 0xbf);
+            else if (c == 0xf0) state = UTF8_STATE(3, 0x90, 0xbf);
+            else if (c < 0xf4) state = UTF8_STATE(3, 0x80, 0xbf);
+            else state = UTF8_STATE(3, 0x80, 0x8f);
+        } else {
+            if (c < (state & 0xff) || c > ((state >> 8) & 0xff)) return WS_UTF8_REJECT;
+            state = (state >> 16) > 1 ? UTF8_STATE((state >> 16) - 1, 0x80, 0xbf) : WS_UTF8_ACCEPT;
+        }
+    }
+    return state;
+}
+
+/**
+ * fused kernels, they unmask a block, skip it when it is ascii between two
+ * characters and run the state machine over the unmasked bytes otherwise.
+ */
+typedef uint32_t (*libws_mask_utf8_fn)(char *buff, const char *payload, uint64_t length, uint32_t key, uint32_t state);
+
+static uint32_t
+mask_utf8_word(char *buff, const char *payload, uint64_t length, uint32_t key, uint32_t state) {
+    uint64_t i, w, k;
+    const char *m = (const char *)&key;
+
+    k = ((uint64_t)key << 32) | key;
+    for (i = 0; i + 8 <= length; i += 8) {
+        memcpy(&w, payload + i, 8);
+        w ^= k;
+        memcpy(buff + i, &w, 8);
+        if (state != WS_UTF8_ACCEPT || (w & 0x8080808080808080ULL)) {
+            if ((state = utf8_run(state, (const unsigned char *)buff + i, 8)) == WS_UTF8_REJECT)
+                return state;
+        }
+    }
+    for (; i < length; i++)
+        buff[i] = payload[i] ^ m[i & 3];
+    return utf8_run(state, (const unsigned char *)buff + length - (length & 7), length & 7);
+}
+
+#ifdef LIBWS_X86
+static uint32_t
+mask_utf8_sse2(char *buff, const char *payload, uint64_t length, uint32_t key, uint32_t state) {
+    uint64_t i = 0;
+    __m128i k = _mm_set1_epi32((int)key);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(payload + i)), k);
+        _mm_storeu_si128((__m128i *)(buff + i), a);
+        if (state != WS_UTF8_ACCEPT || _mm_movemask_epi8(a)) {
+            if ((state = utf8_run(state, (const unsigned char *)buff + i, 16)) == WS_UTF8_REJECT)
+                return state;
+        }
+    }
+    return mask_utf8_word(buff + i, payload + i, length - i, key, state);
+}
+
+/**
+ * the avx2 kernel validates 32 bytes at a time with nibble lookups, every error
+ * of a byte with the 3 before it sets a bit in all 3 lookups, the lead of a
+ * sequence split across calls is rebuilt from the state.
+ * see "Validating UTF-8 In Less Than One Instruction Per Byte", Keiser and Lemire.
+ */
+#define UTF8_TOO_SHORT      0x01
+#define UTF8_TOO_LONG       0x02
+#define UTF8_OVERLONG_3     0x04
+#define UTF8_TOO_LARGE      0x08
+#define UTF8_SURROGATE      0x10
+#define UTF8_OVERLONG_2     0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4     0x40
+#define UTF8_TWO_CONTS      0x80
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const char utf8_byte_1_high[16] = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    (char)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+};
+
+static const char utf8_byte_1_low[16] = {
+    (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+    (char)(UTF8_CARRY | UTF8_OVERLONG_2),
+    (char)UTF8_CARRY,
+    (char)UTF8_CARRY,
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+};
+
+static const char utf8_byte_2_high[16] = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+};
+
+/* a lead byte which leaves the same state */
+static unsigned char
+utf8_lead(uint32_t state) {
+    switch (state) {
+    case UTF8_STATE(1, 0x80, 0xbf): return 0xc2;
+    case UTF8_STATE(2, 0xa0, 0xbf): return 0xe0;
+    case UTF8_STATE(2, 0x80, 0x9f): return 0xed;
+    case UTF8_STATE(2, 0x80, 0xbf): return 0xe1;
+    case UTF8_STATE(3, 0x90, 0xbf): return 0xf0;
+    case UTF8_STATE(3, 0x80, 0xbf): return 0xf1;
+    case UTF8_STATE(3, 0x80, 0x8f): return 0xf4;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2"))) static uint32_t
+mask_utf8_avx2(char *buff, const char *payload, uint64_t length, uint32_t key, uint32_t state) {
+    static const char last[32] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xef, (char)0xdf, (char)0xbf,
+    };
+    char head[32] = {0};
+    uint64_t i, j;
+    __m256i k, t1h, t1l, t2h, nibble, max, prev, incomplete, error;
+
+    if (length < 32)
+        return mask_utf8_word(buff, payload, length, key, state);
+    k = _mm256_set1_epi32((int)key);
+    t1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_high));
+    t1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_low));
+    t2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_2_high));
+    nibble = _mm256_set1_epi8(0x0f);
+    max = _mm256_loadu_si256((const __m256i *)last);
+    head[31] = (char)utf8_lead(state);
+    prev = _mm256_loadu_si256((const __m256i *)head);
+    incomplete = _mm256_subs_epu8(prev, max);
+    error = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i in, p1, p2, p3, sc, must23;
+
+        in = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(payload + i)), k);
+        _mm256_storeu_si256((__m256i *)(buff + i), in);
+        if (!_mm256_movemask_epi8(in)) {
+            /* ascii, only a sequence left open by the block before is an error */
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+            prev = in;
+            continue;
+        }
+        p3 = _mm256_permute2x128_si256(prev, in, 0x21);
+        p1 = _mm256_alignr_epi8(in, p3, 15);
+        p2 = _mm256_alignr_epi8(in, p3, 14);
+        p3 = _mm256_alignr_epi8(in, p3, 13);
+        sc = _mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(p1, 4), nibble));
+        sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(t1l, _mm256_and_si256(p1, nibble)));
+        sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+        /* the third and fourth bytes of a sequence must be continuations */
+        must23 = _mm256_or_si256(_mm256_subs_epu8(p2, _mm256_set1_epi8(0xe0 - 0x80)),
+                                 _mm256_subs_epu8(p3, _mm256_set1_epi8(0xf0 - 0x80)));
+        must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+        incomplete = _mm256_subs_epu8(in, max);
+        prev = in;
+    }
+    j = _mm256_testz_si256(error, error);
+    _mm256_zeroupper();
+    if (!j)
+        return WS_UTF8_REJECT;
+
+    /* the sequence open at the end of the blocks starts in their last 3 bytes */
+    for (j = i - 1; j > i - 3 && ((unsigned char)buff[j] & 0xc0) == 0x80; j--);
+    state = ((unsigned char)buff[j] & 0xc0) == 0x80 ? WS_UTF8_ACCEPT
+        : utf8_run(WS_UTF8_ACCEPT, (const unsigned char *)buff + j, i - j);
+    if (state == WS_UTF8_REJECT)
+        return state;
+    return mask_utf8_word(buff + i, payload + i, length - i, key, state);
+}
+#endif
+
+static const struct {
+    const char *name;
+    libws_mask_fn fn;
+    libws_mask_utf8_fn utf8;
+} mask_kernels[] = {
+#ifdef LIBWS_X86
+    {"avx2", mask_avx2, mask_utf8_avx2},
+    {"sse2", mask_sse2, mask_utf8_sse2},
+#endif
+    {"word", mask_word, mask_utf8_word},
+};
+
+static int mask_kernel = -1;
+
+static int
+mask_supported(const char *name) {
+#ifdef LIBWS_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+    return !strcmp(name, "word");
+}
+
+static void
+mask_select(void) {
+    int i;
+    for (i = 0; i < (int)(sizeof mask_kernels / sizeof mask_kernels[0]); i++) {
+        if (mask_supported(mask_kernels[i].name)) {
+            mask_kernel = i;
+            return;
+        }
+    }
+}
+
+uint64_t
+libws__mask(char *buff, const char mask[4], const char *payload, uint64_t length, uint64_t offset) {
+    char rotated[4];
+    uint32_t key;
+
+    rotated[0] = mask[offset & 3];
+    rotated[1] = mask[(offset + 1) & 3];
+    rotated[2] = mask[(offset + 2) & 3];
+    rotated[3] = mask[(offset + 3) & 3];
+    memcpy(&key, rotated, 4);
+    if (length < 32) {
+        mask_word(buff, payload, length, key);
+    } else {
+        if (mask_kernel < 0) mask_select();
+        mask_kernels[mask_kernel].fn(buff, payload, length, key);
+    }
+    return (offset + length) & 3;
+}
+
+uint64_t
+libws__mask_utf8(char *buff, const char mask[4], const char *payload, uint64_t length, uint64_t offset,
+                 uint32_t *state) {
+    char rotated[4];
+    uint32_t key;
+
+    if (*state == WS_UTF8_REJECT)
+        return (offset + length) & 3;
+    rotated[0] = mask[offset & 3];
+    rotated[1] = mask[(offset + 1) & 3];
+    rotated[2] = mask[(offset + 2) & 3];
+    rotated[3] = mask[(offset + 3) & 3];
+    memcpy(&key, rotated, 4);
+    if (length < 32) {
+        *state = mask_utf8_word(buff, payload, length, key, *state);
+    } else {
+        if (mask_kernel < 0) mask_select();
+        *state = mask_kernels[mask_kernel].utf8(buff, payload, length, key, *state);
+    }
+    return (offset + length) & 3;
+}
+
+const char *
+libws__mask_impl(void) {
+    if (mask_kernel < 0) mask_select();
+    return mask_kernels[mask_kernel].name;
 }
 
 uint64_t
@@ -290,43 +877,55 @@ libws__build_size(int mask, uint64_t length) {
     return 2 + length + (mask ? 4 : 0) + (length >= 0x7e ? (length > 0xffff ? 8 : 2) : 0);
 }
 
-void
-libws__build(char *data, int flags, struct libws_b *payload) {
+int
+libws__build_header(char head[WS_FRAME_HEADER_MAX], int flags, uint64_t length) {
     int offset;
     uint32_t mask = WS_MASK;
-    uint64_t length = payload->length;
 
-    data[0] = 0;
-    data[1] = 0;
-    if (flags & WS_FLAG_FIN) data[0] = (char)(1 << 7);
-    data[0] |= (char)(flags & 0xf);
-    if (flags & WS_FLAG_MASK) data[1] = (char)(1 << 7);
+    head[0] = 0;
+    head[1] = 0;
+    if (flags & WS_FLAG_FIN) head[0] = (char)(1 << 7);
+    if (flags & WS_FLAG_RSV1) head[0] |= 0x40;
+    head[0] |= (char)(flags & 0xf);
+    if (flags & WS_FLAG_MASK) head[1] = (char)(1 << 7);
     if (length < 0x7e) {
-        data[1] |= (char)length;
+        head[1] |= (char)length;
         offset = 2;
     } else if (length <= 0xffff) {
-        data[1] |= 0x7e;
-        data[2] = (char)(length >> 8);
-        data[3] = (char)(length & 0xff);
+        head[1] |= 0x7e;
+        head[2] = (char)(length >> 8);
+        head[3] = (char)(length & 0xff);
         offset = 4;
     } else {
-        data[1] |= 0x7f;
-        data[2] = (char)((length >> 56) & 0xff);
-        data[3] = (char)((length >> 48) & 0xff);
-        data[4] = (char)((length >> 40) & 0xff);
-        data[5] = (char)((length >> 32) & 0xff);
-        data[6] = (char)((length >> 24) & 0xff);
-        data[7] = (char)((length >> 16) & 0xff);
-        data[8] = (char)((length >>  8) & 0xff);
-        data[9] = (char)((length >>  0) & 0xff);
+        head[1] |= 0x7f;
+        head[2] = (char)((length >> 56) & 0xff);
+        head[3] = (char)((length >> 48) & 0xff);
+        head[4] = (char)((length >> 40) & 0xff);
+        head[5] = (char)((length >> 32) & 0xff);
+        head[6] = (char)((length >> 24) & 0xff);
+        head[7] = (char)((length >> 16) & 0xff);
+        head[8] = (char)((length >>  8) & 0xff);
+        head[9] = (char)((length >>  0) & 0xff);
         offset = 10;
     }
     if (flags & WS_FLAG_MASK) {
-        memcpy(&data[offset], &mask, 4);
+        memcpy(&head[offset], &mask, 4);
         offset += 4;
-        if (payload->data && length)
-            frame_mask(&data[offset], (char *)&mask, payload->data, length, 0);
-    } else if (payload->data && length)
+    }
+    return offset;
+}
+
+void
+libws__build(char *data, int flags, struct libws_b *payload) {
+    int offset;
+    uint64_t length = payload->length;
+
+    offset = libws__build_header(data, flags, length);
+    if (!payload->data || !length)
+        return;
+    if (flags & WS_FLAG_MASK)
+        libws__mask(&data[offset], &data[offset - 4], payload->data, length, 0);
+    else
         memcpy(&data[offset], payload->data, length);
 }
 
@@ -336,185 +935,723 @@ libws__parser_init(struct libws_parser *p) {
     p->state = s_start;
 }
 
+void
+libws__parser_mode(struct libws_parser *p, int mode) {
+    p->mode = mode;
+}
+
+void
+libws__parser_limit(struct libws_parser *p, uint64_t max_length) {
+    p->max_length = max_length;
+}
+
+void
+libws__parser_allocator(struct libws_parser *p, const struct libws_allocator *a) {
+    p->a = a;
+}
+
+void
+libws__frame_free(struct libws_parser *p, struct libws_frame *f) {
+    if (f->owned)
+        libws__free(p->a, f->payload.data);
+    f->owned = 0;
+    f->payload.data = 0;
+}
+
+void
+libws__parser_free(struct libws_parser *p) {
+    if (p->data != p->control)
+        libws__free(p->a, p->data);
+    p->data = 0;
+    p->state = s_start;
+}
+
+static void
+frame_done(struct libws_parser *p, struct libws_frame *f, char *data, uint64_t length, int owned) {
+    f->opcode = p->flags & 0xf;
+    f->fin = !!(p->flags & WS_FLAG_FIN);
+    f->mask = !!(p->flags & WS_FLAG_MASK);
+    f->rsv1 = !!(p->flags & WS_FLAG_RSV1);
+    f->owned = owned;
+    f->payload.data = data;
+    f->payload.length = length;
+    f->offset = 0;
+    f->remain = 0;
+}
+
+/** a text frame, or a continuation of a text message, to validate */
+static int
+frame_text(struct libws_parser *p) {
+    return (p->mode & WS_PARSER_UTF8) && p->text && !(p->flags & 0x8);
+}
+
+/**
+ * unmask length payload bytes from src into dst, which may be src, and validate
+ * the text ones. return -1 on invalid UTF-8
+ */
+static int
+frame_unmask(struct libws_parser *p, char *dst, const char *src, uint64_t length) {
+    static const char nomask[4];
+
+    if (frame_text(p)) {
+        /* an unmasked frame is xored with zero to copy and validate in one pass */
+        p->mask_offset = libws__mask_utf8(dst, (p->flags & WS_FLAG_MASK) ? p->mask : nomask, src, length,
+                                          p->mask_offset, &p->utf8);
+        if (p->utf8 == WS_UTF8_REJECT) {
+            p->error = WS_STATUS_INVALID_PAYLOAD;
+            return -1;
+        }
+    } else if (p->flags & WS_FLAG_MASK) {
+        p->mask_offset = libws__mask(dst, p->mask, src, length, p->mask_offset);
+    } else if (dst != src) {
+        memcpy(dst, src, length);
+    }
+    return 0;
+}
+
+/** the whole payload is unmasked, a text message must not end inside a character */
+static int
+frame_end(struct libws_parser *p) {
+    if (frame_text(p) && (p->flags & WS_FLAG_FIN)) {
+        p->text = 0;
+        if (p->utf8 != WS_UTF8_ACCEPT) {
+            p->error = WS_STATUS_INVALID_PAYLOAD;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * the frame header is parsed and *s is the first payload byte.
+ * return 1 when the frame is complete, 0 when the payload is pending, -1 on error
+ */
+static int
+frame_payload(struct libws_parser *p, struct libws_frame *f, char **s, char *e) {
+    if ((p->flags & WS_FLAG_RSV23) || ((p->flags & WS_FLAG_RSV1) &&
+        (!(p->mode & WS_PARSER_RSV1) || (p->flags & 0x8) || (p->flags & 0xf) == WS_OPCODE_CONTINUATION))) {
+        p->error = WS_STATUS_PROTOCOL_ERROR;
+        return -1;
+    }
+    if (p->flags & 0x8) {
+        if (p->length > WS_CONTROL_MAX || !(p->flags & WS_FLAG_FIN)) {
+            p->error = WS_STATUS_PROTOCOL_ERROR;
+            return -1;
+        }
+    } else {
+        if (p->max_length && p->length > p->max_length) {
+            p->error = WS_STATUS_MESSAGE_TOO_BIG;
+            return -1;
+        }
+        if ((p->flags & 0xf) != WS_OPCODE_CONTINUATION) {
+            p->text = (p->flags & 0xf) == WS_OPCODE_TEXT && !(p->flags & WS_FLAG_RSV1);
+            p->utf8 = WS_UTF8_ACCEPT;
+        }
+    }
+    p->offset = 0;
+    p->mask_offset = 0;
+    if (!p->length) {
+        if (frame_end(p)) return -1;
+        p->state = s_start;
+        frame_done(p, f, 0, 0, 0);
+        return 1;
+    }
+    p->state = s_body;
+    p->require = p->length;
+    /* control frames are short, they are always delivered whole */
+    if ((p->mode & WS_PARSER_STREAM) && !(p->flags & 0x8))
+        return 0;
+    if ((p->mode & (WS_PARSER_INPLACE | WS_PARSER_STREAM)) && (uint64_t)(e - *s) >= p->length) {
+        if (frame_unmask(p, *s, *s, p->length) || frame_end(p))
+            return -1;
+        p->state = s_start;
+        frame_done(p, f, *s, p->length, 0);
+        *s += p->length;
+        return 1;
+    }
+    if (p->flags & 0x8) {
+        p->data = p->control;
+        return 0;
+    }
+    if ((uint64_t)(size_t)p->length != p->length) {
+        p->error = WS_STATUS_MESSAGE_TOO_BIG;
+        return -1;
+    }
+    p->data = libws__alloc(p->a, (size_t)p->length);
+    if (!p->data) {
+        p->error = WS_STATUS_UNEXPECTED_CONDITION;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * decode a whole frame header at *s with a few loads.
+ * return -2 when the header is not complete in the buffer, else as frame_payload()
+ */
+static int
+frame_header(struct libws_parser *p, struct libws_frame *f, char **s, char *e) {
+    const unsigned char *h = (const unsigned char *)*s;
+    uint64_t length;
+    uint16_t length16;
+    long need;
+
+    if (e - *s < 2) return -2;
+    need = 2 + ((h[1] & 0x80) ? 4 : 0);
+    length = h[1] & 0x7f;
+    if (length == 0x7e) need += 2;
+    else if (length == 0x7f) need += 8;
+    if (e - *s < need) return -2;
+
+    p->flags = h[0] & 0xf;
+    if (h[0] & 0x80) p->flags |= WS_FLAG_FIN;
+    if (h[0] & 0x40) p->flags |= WS_FLAG_RSV1;
+    if (h[0] & 0x30) p->flags |= WS_FLAG_RSV23;
+    if (h[1] & 0x80) p->flags |= WS_FLAG_MASK;
+    h += 2;
+    if (length == 0x7e) {
+        memcpy(&length16, h, 2);
+        length = WS_NTOH16(length16);
+        h += 2;
+    } else if (length == 0x7f) {
+        memcpy(&length, h, 8);
+        length = WS_NTOH64(length);
+        h += 8;
+    }
+    if (p->flags & WS_FLAG_MASK)
+        memcpy(p->mask, h, 4);
+    p->length = length;
+    *s += need;
+    return frame_payload(p, f, s, e);
+}
+
 int
 libws__parser_execute(struct libws_parser *p, struct libws_b *b, struct libws_frame *f) {
     char *s = b->data;
     char *e = b->data + b->length;
-    long offset = 0;
+    uint64_t n;
+    int rc = 0;
 
-    while (s < e) {
+    if (p->error) return -1;
+    while (s < e && !rc) {
         switch(p->state) {
         case s_start:
-            p->offset = 0;
+            /* the byte by byte states only run for headers split across reads */
+            if ((rc = frame_header(p, f, &s, e)) != -2)
+                break;
+            rc = 0;
             p->length = 0;
-            p->mask_offset = 0;
             p->flags = ((*s) & 0xf);
             if ((*s) & (1 << 7))
                 p->flags |= WS_FLAG_FIN;
+            if ((*s) & 0x40)
+                p->flags |= WS_FLAG_RSV1;
+            if ((*s) & 0x30)
+                p->flags |= WS_FLAG_RSV23;
             p->state = s_head;
-            offset++;
             s++;
             break;
         case s_head:
             p->length  = (*s) & 0x7f;
             if ((*s) & 0x80)
                 p->flags |= WS_FLAG_MASK;
+            s++;
             if (p->length >= 0x7e) {
-                if (p->length == 0x7f)
-                    p->require = 8;
-                else
-                    p->require = 2;
+                p->require = p->length == 0x7f ? 8 : 2;
                 p->length = 0;
                 p->state = s_length;
             } else if (p->flags & WS_FLAG_MASK) {
                 p->state = s_mask;
                 p->require = 4;
-            } else if (p->length) {
-                p->state = s_body;
-                p->require = p->length;
-                f->opcode = p->flags & 0xf;
-                f->fin = !!(p->flags & 0x10);
-                f->mask = !!(p->flags & 0x20);
-                f->payload.length = p->length;
-                f->payload.data = malloc(p->length);
             } else {
-                p->state = s_start;
-                f->opcode = p->flags & 0xf;
-                f->fin = !!(p->flags & 0x10);
-                f->mask = !!(p->flags & 0x20);
-                f->payload.length = p->length;
-                f->payload.data = 0;
-                b->length = e - s;
-                b->data = s;
-                return 1;
+                rc = frame_payload(p, f, &s, e);
             }
-            offset++;
-            s++;
             break;
         case s_length:
             while(s < e && p->require) {
                 p->length <<= 8;
                 p->length |= (unsigned char)(*s);
                 p->require--;
-                offset++;
                 s++;
             }
             if (!p->require) {
                 if (p->flags & WS_FLAG_MASK) {
                     p->state = s_mask;
                     p->require = 4;
-                } else if (p->length) {
-                    p->state = s_body;
-                    p->require = p->length;
-                    f->opcode = p->flags & 0xf;
-                    f->fin = !!(p->flags & 0x10);
-                    f->mask = !!(p->flags & 0x20);
-                    f->payload.length = p->length;
-                    f->payload.data = malloc(p->length);
                 } else {
-                    p->state = s_start;
-                    f->opcode = p->flags & 0xf;
-                    f->fin = !!(p->flags & 0x10);
-                    f->mask = !!(p->flags & 0x20);
-                    f->payload.length = p->length;
-                    f->payload.data = 0;
-                    b->length = e - s;
-                    b->data = s;
-                    return 1;
+                    rc = frame_payload(p, f, &s, e);
                 }
             }
             break;
         case s_mask:
             while(s < e && p->require) {
                 p->mask[4 - p->require--] = *s;
-                offset++;
                 s++;
             }
-            if (!p->require) {
-                if (p->length) {
-                    p->state = s_body;
-                    p->require = p->length;
-                    f->opcode = p->flags & 0xf;
-                    f->fin = !!(p->flags & 0x10);
-                    f->mask = !!(p->flags & 0x20);
-                    f->payload.length = p->length;
-                    f->payload.data = malloc(p->length);
-                } else {
-                    p->state = s_start;
-                    f->opcode = p->flags & 0xf;
-                    f->fin = !!(p->flags & 0x10);
-                    f->mask = !!(p->flags & 0x20);
-                    f->payload.length = p->length;
-                    f->payload.data = 0;
-                    b->length = e - s;
-                    b->data = s;
-                    return 1;
-                }
-            }
+            if (!p->require)
+                rc = frame_payload(p, f, &s, e);
             break;
         case s_body:
-            if (p->require) {
-                if (s + p->require <= e) {
-                    p->mask_offset = frame_mask(f->payload.data + p->offset, p->mask, s, p->require, p->mask_offset);
-                    s += p->require;
-                    p->require = 0;
-                    offset = s - b->data;
-                } else {
-                    p->mask_offset = frame_mask(f->payload.data + p->offset, p->mask, s, (uint64_t)(e - s), p->mask_offset);
-                    p->require -= (uint64_t)(e - s);
-                    s = e;
-                    p->offset += (uint64_t)(s - b->data - offset);
-                    offset = 0;
+            n = (uint64_t)(e - s) < p->require ? (uint64_t)(e - s) : p->require;
+            if (!p->data) {
+                /* streaming, hand the chunk out unmasked in place */
+                if (frame_unmask(p, s, s, n) || (n == p->require && frame_end(p))) {
+                    rc = -1;
+                    break;
                 }
+                p->require -= n;
+                frame_done(p, f, s, n, 0);
+                f->offset = p->offset;
+                f->remain = p->require;
+                p->offset += n;
+                s += n;
+                if (!p->require)
+                    p->state = s_start;
+                rc = 1;
+                break;
+            }
+            if (frame_unmask(p, p->data + p->offset, s, n) || (n == p->require && frame_end(p))) {
+                rc = -1;
+                break;
             }
+            p->offset += n;
+            p->require -= n;
+            s += n;
             if (!p->require) {
                 p->state = s_start;
-                f->opcode = p->flags & 0xf;
-                f->fin = !!(p->flags & 0x10);
-                f->mask = !!(p->flags & 0x20);
-                f->payload.length = p->length;
-                b->length = e - s;
-                b->data = s;
-                return 1;
+                frame_done(p, f, p->data, p->length, p->data != p->control);
+                p->data = 0;
+                rc = 1;
             }
             break;
         }
     }
-    return 0;
+    b->length = e - s;
+    b->data = s;
+    return rc;
+}
+
+int
+libws__parser_execute_many(struct libws_parser *p, struct libws_b *b, struct libws_frame *frames, int n) {
+    char *s = b->data;
+    char *e = b->data + b->length;
+    int i = 0, rc = 0;
+
+    if (p->error) return -1;
+    while (i < n && s < e) {
+        rc = p->state == s_start ? frame_header(p, &frames[i], &s, e) : -2;
+        if (rc == -2 || rc == 0) {
+            /* a split header or a pending payload goes through the state machine */
+            b->data = s;
+            b->length = e - s;
+            rc = libws__parser_execute(p, b, &frames[i]);
+            s = b->data;
+        }
+        if (rc <= 0)
+            break;
+        /* the next control frame would take its buffer */
+        if (frames[i++].payload.data == p->control)
+            break;
+    }
+    b->data = s;
+    b->length = e - s;
+    return (rc < 0 && !i) ? -1 : i;
+}
+
+/**
+ * SHA-1 of the 60 bytes of key and secret, always two blocks. the second one is
+ * only padding and length, so its message schedule is a constant.
+ */
+#define SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t sha1_h0[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+/** the schedule of the padding block of a 60 bytes message, with the round constants added */
+static const uint32_t sha1_pad_wk[80] = {
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999,
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999,
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827b79, 0x5a827999, 0x5a827999,
+    0x5a827d59, 0x5a827999, 0x6ed9eba1, 0x6ed9f321, 0x6ed9eba1, 0x6ed9ef61,
+    0x6ed9faa1, 0x6ed9eba1, 0x6ed9eba1, 0x6eda09a1, 0x6ed9eba1, 0x6ed9f861,
+    0x6eda27a1, 0x6ed9efe1, 0x6ed9eba1, 0x6eda63a1, 0x6ed9faa1, 0x6eda1ea1,
+    0x6edadba1, 0x6ed9faa1, 0x6ed9eba1, 0x6edbdaa1, 0x8f1bbcdc, 0x8f1c88dc,
+    0x8f1f7cdc, 0x8f1c005c, 0x8f1bbcdc, 0x8f234bdc, 0x8f1cbbdc, 0x8f1ee35c,
+    0x8f2abcdc, 0x8f1cacdc, 0x8f1befdc, 0x8f3abbdc, 0x8f1bbcdc, 0x8f2874dc,
+    0x8f57bcdc, 0x8f1fc7dc, 0x8f1cacdc, 0x8f94bbdc, 0x8f2bacdc, 0x8f4f43dc,
+    0xcb52c1d6, 0xca7284d6, 0xca63b1d6, 0xcc527cd6, 0xca62c1d6, 0xcb2ec1d6,
+    0xce23b1d6, 0xcaa641d6, 0xca62c1d6, 0xd1f1c1d6, 0xcb61c1d6, 0xcd895fd6,
+    0xd962c1d6, 0xcb53b1d6, 0xca95fdd6, 0xe96249d6, 0xca62c1d6, 0xd71b49d6,
+    0x0663b1d6, 0xce6d0bd6,
+};
+
+/** the same padding block as bytes */
+static const unsigned char sha1_pad[64] = {[62] = 0x01, [63] = 0xe0};
+
+static uint32_t
+sha1_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+sha1_rounds(uint32_t h[5], const uint32_t wk[80]) {
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], t;
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        t = SHA1_ROL(a, 5) + (d ^ (b & (c ^ d))) + e + wk[i];
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;
+    }
+    for (; i < 40; i++) {
+        t = SHA1_ROL(a, 5) + (b ^ c ^ d) + e + wk[i];
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;
+    }
+    for (; i < 60; i++) {
+        t = SHA1_ROL(a, 5) + ((b & c) | (d & (b | c))) + e + wk[i];
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;
+    }
+    for (; i < 80; i++) {
+        t = SHA1_ROL(a, 5) + (b ^ c ^ d) + e + wk[i];
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+static void
+sha1_accept_scalar(uint32_t h[5], const unsigned char block[64]) {
+    uint32_t w[80];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = sha1_be32(block + 4 * i);
+    for (; i < 80; i++)
+        w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    for (i = 0; i < 80; i++)
+        w[i] += i < 20 ? 0x5a827999 : i < 40 ? 0x6ed9eba1 : i < 60 ? 0x8f1bbcdc : 0xca62c1d6;
+    sha1_rounds(h, w);
+    sha1_rounds(h, sha1_pad_wk);
+}
+
+#ifdef LIBWS_X86
+/**
+ * four rounds g of the SHA extensions, the schedule of the next rounds
+ * is computed from the words of these ones while they run
+ */
+#define SHA1NI_ROUNDS(g, ecur, enext)                                               \
+    do {                                                                            \
+        ecur = (g) ? _mm_sha1nexte_epu32(ecur, m[(g) % 4]) : _mm_add_epi32(ecur, m[0]); \
+        enext = abcd;                                                               \
+        if ((g) >= 3 && (g) <= 18)                                                  \
+            m[((g) + 1) % 4] = _mm_sha1msg2_epu32(m[((g) + 1) % 4], m[(g) % 4]);    \
+        abcd = _mm_sha1rnds4_epu32(abcd, ecur, (g) / 5);                            \
+        if ((g) >= 1 && (g) <= 16)                                                  \
+            m[((g) + 3) % 4] = _mm_sha1msg1_epu32(m[((g) + 3) % 4], m[(g) % 4]);    \
+        if ((g) >= 2 && (g) <= 17)                                                  \
+            m[((g) + 2) % 4] = _mm_xor_si128(m[((g) + 2) % 4], m[(g) % 4]);         \
+    } while (0)
+
+__attribute__((target("sha,sse4.1"))) static void
+sha1_block_shani(__m128i *state_abcd, __m128i *state_e, const unsigned char *block) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = *state_abcd, e0 = *state_e, e1, m[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 16 * i)), bswap);
+    SHA1NI_ROUNDS(0, e0, e1);
+    SHA1NI_ROUNDS(1, e1, e0);
+    SHA1NI_ROUNDS(2, e0, e1);
+    SHA1NI_ROUNDS(3, e1, e0);
+    SHA1NI_ROUNDS(4, e0, e1);
+    SHA1NI_ROUNDS(5, e1, e0);
+    SHA1NI_ROUNDS(6, e0, e1);
+    SHA1NI_ROUNDS(7, e1, e0);
+    SHA1NI_ROUNDS(8, e0, e1);
+    SHA1NI_ROUNDS(9, e1, e0);
+    SHA1NI_ROUNDS(10, e0, e1);
+    SHA1NI_ROUNDS(11, e1, e0);
+    SHA1NI_ROUNDS(12, e0, e1);
+    SHA1NI_ROUNDS(13, e1, e0);
+    SHA1NI_ROUNDS(14, e0, e1);
+    SHA1NI_ROUNDS(15, e1, e0);
+    SHA1NI_ROUNDS(16, e0, e1);
+    SHA1NI_ROUNDS(17, e1, e0);
+    SHA1NI_ROUNDS(18, e0, e1);
+    SHA1NI_ROUNDS(19, e1, e0);
+    *state_e = _mm_sha1nexte_epu32(e0, *state_e);
+    *state_abcd = _mm_add_epi32(abcd, *state_abcd);
+}
+
+__attribute__((target("sha,sse4.1"))) static void
+sha1_accept_shani(uint32_t h[5], const unsigned char block[64]) {
+    __m128i abcd, e;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    e = _mm_set_epi32((int)h[4], 0, 0, 0);
+    sha1_block_shani(&abcd, &e, block);
+    sha1_block_shani(&abcd, &e, sha1_pad);
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = (uint32_t)_mm_extract_epi32(e, 3);
+}
+#endif
+
+typedef void (*libws_sha1_fn)(uint32_t h[5], const unsigned char block[64]);
+
+static const struct {
+    const char *name;
+    libws_sha1_fn fn;
+} sha1_kernels[] = {
+#ifdef LIBWS_X86
+    {"sha-ni", sha1_accept_shani},
+#endif
+    {"scalar", sha1_accept_scalar},
+};
+
+static int sha1_kernel = -1;
+
+static int
+sha1_supported(const char *name) {
+#ifdef LIBWS_X86
+    /* the SHA extensions are not known to every __builtin_cpu_supports() */
+    if (!strcmp(name, "sha-ni")) {
+        unsigned int eax, ebx, ecx, edx;
+        __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+        if (eax < 7) return 0;
+        __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+        __builtin_cpu_init();
+        return (ebx >> 29) & 1 && __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return !strcmp(name, "scalar");
+}
+
+static void
+sha1_select(void) {
+    int i;
+    for (i = 0; i < (int)(sizeof sha1_kernels / sizeof sha1_kernels[0]); i++) {
+        if (sha1_supported(sha1_kernels[i].name)) {
+            sha1_kernel = i;
+            return;
+        }
+    }
+}
+
+const char *
+libws__sha1_impl(void) {
+    if (sha1_kernel < 0) sha1_select();
+    return sha1_kernels[sha1_kernel].name;
+}
+
+/** base64 of n bytes into 4 * ((n + 2) / 3) chars, with padding */
+static void
+base64_encode(char *dst, const unsigned char *src, int n) {
+    uint32_t v;
+
+    for (; n >= 3; n -= 3, src += 3, dst += 4) {
+        v = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+        dst[0] = b64[v >> 18];
+        dst[1] = b64[(v >> 12) & 0x3f];
+        dst[2] = b64[(v >> 6) & 0x3f];
+        dst[3] = b64[v & 0x3f];
+    }
+    if (n) {
+        v = (uint32_t)src[0] << 16 | (n > 1 ? (uint32_t)src[1] << 8 : 0);
+        dst[0] = b64[v >> 18];
+        dst[1] = b64[(v >> 12) & 0x3f];
+        dst[2] = n > 1 ? b64[(v >> 6) & 0x3f] : '=';
+        dst[3] = '=';
+    }
 }
 
 void
 libws__generate_key(char key[WS_KEY_LEN]) {
     unsigned char randkey[16];
-    unsigned char _key[WS_KEY_LEN+1];
-    int i, n;
+    int i;
 
     for (i = 0; i < 16; i++) {
         randkey[i] = b64[(rand() + time(0)) % 61];
     }
-    n = EVP_EncodeBlock(_key, randkey, 16);
-    assert(n == WS_KEY_LEN);
-    strncpy(key, (char *)_key, WS_KEY_LEN);
+    base64_encode(key, randkey, 16);
+}
+
+/** the first block is the whole message, the end of padding and the length are in the second */
+static void
+sha1_accept_block(unsigned char block[64], const char key[WS_KEY_LEN]) {
+    memcpy(block, key, WS_KEY_LEN);
+    memcpy(block + WS_KEY_LEN, WS_SECRET, WS_SECRET_LEN);
+    memset(block + WS_KEY_LEN + WS_SECRET_LEN, 0, 64 - WS_KEY_LEN - WS_SECRET_LEN);
+    block[WS_KEY_LEN + WS_SECRET_LEN] = 0x80;
+}
+
+static void
+sha1_accept_encode(char accept[WS_ACCEPT_LEN], const uint32_t h[5]) {
+    unsigned char digest[20];
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        digest[4 * i] = (unsigned char)(h[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h[i];
+    }
+    base64_encode(accept, digest, 20);
 }
 
 void
 libws__generate_accept(char accept[WS_ACCEPT_LEN], const char key[WS_KEY_LEN]) {
-    int n;
-    unsigned char buff[WS_KEY_LEN + WS_SECRET_LEN];
-    unsigned char _accept[WS_ACCEPT_LEN+1];
-    unsigned char *digest;
+    unsigned char block[64];
+    uint32_t h[5];
+
+    sha1_accept_block(block, key);
+    memcpy(h, sha1_h0, sizeof h);
+    if (sha1_kernel < 0) sha1_select();
+    sha1_kernels[sha1_kernel].fn(h, block);
+    sha1_accept_encode(accept, h);
+}
+
+/**
+ * multi-buffer SHA-1, one key in every 32 bits lane of a vector. only the first
+ * 6 words of a message are the key, the others are the secret and the padding.
+ */
+#define SHA1_MANY_MAX 16
+
+#define SHA1_MANY_ROUND(f, wk)                                          \
+    do {                                                                \
+        t = SHA1_ROL(a, 5) + (f) + e + (wk);                            \
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;                \
+    } while (0)
+
+#define SHA1_MANY_SCHEDULE(i)                                           \
+    (i < 16 ? w[i] : (w[i & 15] = SHA1_ROL(w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^ w[i & 15], 1)))
+
+#define SHA1_MANY_KERNEL(name, lanes, isa)                                              \
+    typedef uint32_t name##_v __attribute__((vector_size(4 * (lanes))));                \
+    __attribute__((target(isa))) static void                                            \
+    name(uint32_t (*h)[5], const char **key) {                                          \
+        name##_v w[16], a, b, c, d, e, t, s[5];                                         \
+        int i, l;                                                                       \
+                                                                                        \
+        for (i = 0; i < 16; i++)                                                        \
+            for (l = 0; l < (lanes); l++)                                               \
+                w[i][l] = i < 6 ? sha1_be32((const unsigned char *)key[l] + 4 * i)      \
+                                : sha1_be32(sha1_secret_block + 4 * i);                 \
+        for (i = 0; i < 5; i++)                                                         \
+            s[i] = (name##_v){0} + sha1_h0[i];                                          \
+        a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];                               \
+        for (i = 0; i < 20; i++)                                                        \
+            SHA1_MANY_ROUND(d ^ (b & (c ^ d)), SHA1_MANY_SCHEDULE(i) + 0x5a827999u);    \
+        for (; i < 40; i++)                                                             \
+            SHA1_MANY_ROUND(b ^ c ^ d, SHA1_MANY_SCHEDULE(i) + 0x6ed9eba1u);            \
+        for (; i < 60; i++)                                                             \
+            SHA1_MANY_ROUND((b & c) | (d & (b | c)), SHA1_MANY_SCHEDULE(i) + 0x8f1bbcdcu); \
+        for (; i < 80; i++)                                                             \
+            SHA1_MANY_ROUND(b ^ c ^ d, SHA1_MANY_SCHEDULE(i) + 0xca62c1d6u);            \
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;                          \
+        a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];                               \
+        for (i = 0; i < 20; i++)                                                        \
+            SHA1_MANY_ROUND(d ^ (b & (c ^ d)), sha1_pad_wk[i]);                         \
+        for (; i < 40; i++)                                                             \
+            SHA1_MANY_ROUND(b ^ c ^ d, sha1_pad_wk[i]);                                 \
+        for (; i < 60; i++)                                                             \
+            SHA1_MANY_ROUND((b & c) | (d & (b | c)), sha1_pad_wk[i]);                   \
+        for (; i < 80; i++)                                                             \
+            SHA1_MANY_ROUND(b ^ c ^ d, sha1_pad_wk[i]);                                 \
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;                          \
+        for (l = 0; l < (lanes); l++)                                                   \
+            for (i = 0; i < 5; i++)                                                     \
+                h[l][i] = s[i][l];                                                      \
+    }
+
+/** the first block of any accept, the key is left as zeros */
+static const unsigned char sha1_secret_block[64] = {
+    [24] = '2', '5', '8', 'E', 'A', 'F', 'A', '5', '-', 'E', '9', '1', '4', '-', '4', '7', 'D', 'A',
+    '-', '9', '5', 'C', 'A', '-', 'C', '5', 'A', 'B', '0', 'D', 'C', '8', '5', 'B', '1', '1', 0x80,
+};
+
+#ifdef LIBWS_X86
+SHA1_MANY_KERNEL(sha1_many_avx512, 16, "avx512f")
+SHA1_MANY_KERNEL(sha1_many_avx2, 8, "avx2")
+SHA1_MANY_KERNEL(sha1_many_sse2, 4, "sse2")
+#endif
+
+/** the single block kernel for every key */
+static void
+sha1_many_each(uint32_t (*h)[5], const char **key) {
+    unsigned char block[64];
+
+    sha1_accept_block(block, key[0]);
+    memcpy(h[0], sha1_h0, sizeof h[0]);
+    sha1_kernels[sha1_kernel].fn(h[0], block);
+}
+
+static const struct {
+    const char *name;
+    int lanes;
+    void (*fn)(uint32_t (*h)[5], const char **key);
+} sha1_many_kernels[] = {
+#ifdef LIBWS_X86
+    {"avx512", 16, sha1_many_avx512},
+    {"avx2", 8, sha1_many_avx2},
+    {"sse2", 4, sha1_many_sse2},
+#endif
+    {"each", 1, sha1_many_each},
+};
+
+static int sha1_many_kernel = -1;
+
+static int
+sha1_many_supported(const char *name) {
+#ifdef LIBWS_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx512")) return __builtin_cpu_supports("avx512f");
+    if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2");
+    /* four lanes are slower than the SHA extensions one key after the other */
+    if (!strcmp(name, "sse2")) return __builtin_cpu_supports("sse2") && strcmp(sha1_kernels[sha1_kernel].name, "sha-ni");
+#endif
+    return !strcmp(name, "each");
+}
+
+static void
+sha1_many_select(void) {
+    int i;
+
+    if (sha1_kernel < 0) sha1_select();
+    for (i = 0; i < (int)(sizeof sha1_many_kernels / sizeof sha1_many_kernels[0]); i++) {
+        if (sha1_many_supported(sha1_many_kernels[i].name)) {
+            sha1_many_kernel = i;
+            return;
+        }
+    }
+}
 
-    memcpy(buff, key, WS_KEY_LEN);
-    memcpy(buff + WS_KEY_LEN, WS_SECRET, WS_SECRET_LEN);
-    digest = SHA1(buff, (size_t)(WS_KEY_LEN + WS_SECRET_LEN), 0);
-    n = EVP_EncodeBlock(_accept, digest, SHA_DIGEST_LENGTH);
-    assert(n == WS_ACCEPT_LEN);
-    strncpy(accept, (char *)_accept, WS_ACCEPT_LEN);
+const char *
+libws__sha1_many_impl(int *lanes) {
+    if (sha1_many_kernel < 0) sha1_many_select();
+    if (lanes) *lanes = sha1_many_kernels[sha1_many_kernel].lanes;
+    return sha1_many_kernels[sha1_many_kernel].name;
+}
+
+void
+libws__generate_accept_many(char *accept[], const char *key[], int n) {
+    uint32_t h[SHA1_MANY_MAX][5];
+    const char *batch[SHA1_MANY_MAX];
+    int i, l, lanes, m;
+
+    if (sha1_many_kernel < 0) sha1_many_select();
+    lanes = sha1_many_kernels[sha1_many_kernel].lanes;
+    for (i = 0; i < n; i += lanes) {
+        /* a short batch repeats its last key in the lanes left */
+        m = n - i < lanes ? n - i : lanes;
+        for (l = 0; l < lanes; l++)
+            batch[l] = key[i + (l < m ? l : m - 1)];
+        sha1_many_kernels[sha1_many_kernel].fn(h, batch);
+        for (l = 0; l < m; l++)
+            sha1_accept_encode(accept[i + l], h[l]);
+    }
 }
 
 int
 libws__request(char *request, size_t len, const char *url, const char *host, const char *origin,
-               const char *protocol, char key[WS_KEY_LEN]) {
+               const char *protocol, const char *extensions, char key[WS_KEY_LEN]) {
     libws__generate_key(key);
 
     const char *fmt =
@@ -525,28 +1662,189 @@ libws__request(char *request, size_t len, const char *url, const char *host, con
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Key: %.*s\r\n"
         "Sec-WebSocket-Protocol: %s\r\n"
+        "%s%s%s"
         "Sec-WebSocket-Version: 13\r\n"
         "\r\n";
 
-    return snprintf(request, len, fmt, url, host, origin, WS_KEY_LEN, key, protocol);
+    return snprintf(request, len, fmt, url, host, origin, WS_KEY_LEN, key, protocol,
+                    extensions ? "Sec-WebSocket-Extensions: " : "", extensions ? extensions : "", extensions ? "\r\n" : "");
+}
+
+/** append at n like snprintf() would, return the length as if not truncated */
+static size_t
+response_put(char *buff, size_t len, size_t n, const char *s, size_t slen) {
+    if (n < len)
+        memcpy(buff + n, s, n + slen <= len ? slen : len - n);
+    return n + slen;
 }
 
+#define RESPONSE_PUT(s) n = response_put(response, len, n, s, sizeof(s) - 1)
+
 int
 libws__response(char *response, size_t len, const char *server, const char *protocol,
-                const char key[WS_KEY_LEN], char accept[WS_ACCEPT_LEN]) {
-
+                const char *extensions, const char key[WS_KEY_LEN], char accept[WS_ACCEPT_LEN]) {
     libws__generate_accept(accept, key);
+    return libws__response_accept(response, len, server, protocol, extensions, accept);
+}
 
-    const char *fmt =
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Server: %s\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %.*s\r\n"
-        "Sec-WebSocket-Protocol: %s\r\n"
-        "\r\n";
+int
+libws__response_accept(char *response, size_t len, const char *server, const char *protocol,
+                       const char *extensions, const char accept[WS_ACCEPT_LEN]) {
+    size_t n = 0;
+
+    /* the fields are copied, a reconnect storm formats thousands of these */
+    RESPONSE_PUT("HTTP/1.1 101 Switching Protocols\r\nServer: ");
+    n = response_put(response, len, n, server, strlen(server));
+    RESPONSE_PUT("\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+    n = response_put(response, len, n, accept, WS_ACCEPT_LEN);
+    RESPONSE_PUT("\r\n");
+    if (protocol && protocol[0]) {
+        RESPONSE_PUT("Sec-WebSocket-Protocol: ");
+        n = response_put(response, len, n, protocol, strlen(protocol));
+        RESPONSE_PUT("\r\n");
+    }
+    if (extensions) {
+        RESPONSE_PUT("Sec-WebSocket-Extensions: ");
+        n = response_put(response, len, n, extensions, strlen(extensions));
+        RESPONSE_PUT("\r\n");
+    }
+    RESPONSE_PUT("\r\n");
+    if (len)
+        response[n < len ? n : len - 1] = '\0';
+    return (int)n;
+}
+
+int
+libws__deflate_format(char *buff, size_t len, const struct libws_deflate *d, int offer) {
+    char smwb[32] = "", cmwb[32] = "";
+
+    if (d->server_max_window_bits)
+        snprintf(smwb, sizeof smwb, "; server_max_window_bits=%d", d->server_max_window_bits);
+    if (d->client_max_window_bits)
+        snprintf(cmwb, sizeof cmwb, "; client_max_window_bits=%d", d->client_max_window_bits);
+    else if (offer)
+        /* let the server pick the window of the client */
+        strcpy(cmwb, "; client_max_window_bits");
+    return snprintf(buff, len, "permessage-deflate%s%s%s%s",
+                    d->server_no_context_takeover ? "; server_no_context_takeover" : "",
+                    d->client_no_context_takeover ? "; client_no_context_takeover" : "", smwb, cmwb);
+}
+
+#define EXT_JUNK    '?'
 
-    return snprintf(response, len, fmt, server, WS_ACCEPT_LEN, accept, protocol);
+static void
+ext_space(const char **s, const char *e) {
+    while (*s < e && (**s == ' ' || **s == '\t'))
+        (*s)++;
+}
+
+/**
+ * parse an extension name or parameter at *s, value is -1 without a value
+ * and -2 when it is not a number of at most 2 digits.
+ * return the separator after it, ';', ',', 0 at the end or EXT_JUNK
+ */
+static int
+ext_token(const char **s, const char *e, const char **name, size_t *len, int *value) {
+    int quoted, digits = 0, n = 0;
+
+    ext_space(s, e);
+    *name = *s;
+    while (*s < e && !strchr(" \t;,=", **s))
+        (*s)++;
+    *len = *s - *name;
+    ext_space(s, e);
+    *value = -1;
+    if (*s < e && **s == '=') {
+        (*s)++;
+        ext_space(s, e);
+        quoted = *s < e && **s == '"';
+        if (quoted) (*s)++;
+        while (*s < e && isdigit((unsigned char)**s) && digits < 3) {
+            n = n * 10 + **s - '0';
+            digits++;
+            (*s)++;
+        }
+        if (quoted && (*s >= e || *(*s)++ != '"'))
+            digits = 0;
+        *value = digits && digits < 3 ? n : -2;
+        ext_space(s, e);
+    }
+    if (*s >= e) return 0;
+    if (**s == ';' || **s == ',') return *(*s)++;
+    return EXT_JUNK;
+}
+
+#define EXT_IS(name, len, s)    ((len) == sizeof(s) - 1 && !strncasecmp(name, s, len))
+
+static int
+deflate_agree(struct libws_deflate *d, const struct libws_deflate *want, int issrv, int snct, int cnct, int sbits, int cbits) {
+    int bits;
+
+    if (issrv) {
+        bits = want->server_max_window_bits ? want->server_max_window_bits : 15;
+        if (sbits && sbits < bits) bits = sbits;
+        if (bits < 9) return -1;
+        d->server_no_context_takeover = snct || want->server_no_context_takeover;
+        d->client_no_context_takeover = cnct || want->client_no_context_takeover;
+        d->server_max_window_bits = sbits || bits < 15 ? bits : 0;
+        d->client_max_window_bits = 0;
+        if (cbits >= 0) {
+            /* only limit the window of a client which offered to be limited */
+            bits = want->client_max_window_bits ? want->client_max_window_bits : 15;
+            if (cbits && cbits < bits) bits = cbits;
+            d->client_max_window_bits = bits;
+        }
+        return 0;
+    }
+    if (cbits == 0 || (cbits > 0 && cbits < 9))
+        return -1;
+    if (want->client_max_window_bits && cbits > want->client_max_window_bits)
+        return -1;
+    if (want->server_max_window_bits && (!sbits || sbits > want->server_max_window_bits))
+        return -1;
+    d->server_no_context_takeover = snct;
+    d->client_no_context_takeover = cnct || want->client_no_context_takeover;
+    d->server_max_window_bits = sbits;
+    d->client_max_window_bits = cbits > 0 ? cbits : want->client_max_window_bits;
+    return 0;
+}
+
+int
+libws__deflate_negotiate(struct libws_deflate *d, const struct libws_deflate *want, int issrv,
+                         const char *value, size_t len) {
+    const char *s = value, *e = value + len, *name;
+    size_t n;
+    int sep, v;
+
+    do {
+        int ok, snct = 0, cnct = 0, sbits = 0, cbits = -1;
+
+        sep = ext_token(&s, e, &name, &n, &v);
+        ok = EXT_IS(name, n, "permessage-deflate") && v == -1;
+        while (sep == ';') {
+            sep = ext_token(&s, e, &name, &n, &v);
+            if (EXT_IS(name, n, "server_no_context_takeover") && v == -1 && !snct)
+                snct = 1;
+            else if (EXT_IS(name, n, "client_no_context_takeover") && v == -1 && !cnct)
+                cnct = 1;
+            else if (EXT_IS(name, n, "server_max_window_bits") && v >= 8 && v <= 15 && !sbits)
+                sbits = v;
+            else if (EXT_IS(name, n, "client_max_window_bits") && (v == -1 || (v >= 8 && v <= 15)) && cbits < 0)
+                cbits = v < 0 ? 0 : v;
+            else
+                ok = 0;
+        }
+        if (sep == EXT_JUNK) {
+            /* skip the rest of a malformed offer */
+            ok = 0;
+            while (s < e && *s != ',') s++;
+            sep = s < e ? *s++ : 0;
+        }
+        /* a client offers one extension, the response holds it alone */
+        if (ok && (issrv || !sep) && !deflate_agree(d, want, issrv, snct, cnct, sbits, cbits))
+            return 0;
+    } while (issrv && sep == ',');
+    return -1;
 }
 
 int
@@ -556,44 +1854,55 @@ libws__handshake(const char key[WS_KEY_LEN], const char accept[WS_ACCEPT_LEN]) {
     return 0 == strncmp(check_accept, accept, WS_ACCEPT_LEN) ? 0 : -1;
 }
 
+/** the headers of the handshake, hashed perfectly by the length of their names */
+static const struct {
+    const char *name;
+    int flag;
+} ws_headers[25] = {
+    [7] = {"Upgrade", WS_HEADER_UPGRADE},
+    [10] = {"Connection", WS_HEADER_CONNECTION},
+    [17] = {"Sec-WebSocket-Key", WS_HEADER_KEY},
+    [20] = {"Sec-WebSocket-Accept", WS_HEADER_ACCEPT},
+    [21] = {"Sec-WebSocket-Version", WS_HEADER_VERSION},
+    [22] = {"Sec-WebSocket-Protocol", WS_HEADER_PROTOCOL},
+    [24] = {"Sec-WebSocket-Extensions", WS_HEADER_EXTENSIONS},
+};
+
 int
 libws__valid_header(int *flags, const char *key, size_t key_len, const char *value, size_t value_len) {
-    if (!key || !value) return 0;
+    int flag, valid;
 
-    if (0 == strncasecmp(key, "Sec-WebSocket-Version", key_len)) {
-        if (0 == strncmp(value, "13", value_len)) {
-            *flags |= WS_HEADER_VERSION;
-            return WS_HEADER_VERSION;
-        } else
-            *flags &= ~WS_HEADER_VERSION;
-    } else if (0 == strncasecmp(key, "Upgrade", key_len)) {
-        if (0 == strncasecmp(value, "websocket", value_len)) {
-            *flags |= WS_HEADER_UPGRADE;
-            return WS_HEADER_UPGRADE;
-        } else
-            *flags &= ~WS_HEADER_UPGRADE;
-    } else if (0 == strncasecmp(key, "Connection", key_len)) {
-        if (strncasestr(value, "Upgrade", value_len)) {
-            *flags |= WS_HEADER_CONNECTION;
-            return WS_HEADER_CONNECTION;
-        } else
-            *flags &= ~WS_HEADER_CONNECTION;
-    } else if (0 == strncasecmp(key, "Sec-WebSocket-Key", key_len)) {
-        if (value_len == WS_KEY_LEN) {
-            *flags |= WS_HEADER_KEY;
-            return WS_HEADER_KEY;
-        } else
-            *flags &= ~WS_HEADER_KEY;
-    } else if (0 == strncasecmp(key, "Sec-WebSocket-Accept", key_len)) {
-        if (value_len == WS_ACCEPT_LEN) {
-            *flags |= WS_HEADER_ACCEPT;
-            return WS_HEADER_ACCEPT;
-        } else
-            *flags &= ~WS_HEADER_ACCEPT;
-    } else if (0 == strncasecmp(key, "Sec-WebSocket-Protocol", key_len)) {
-        return WS_HEADER_PROTOCOL;
+    if (!key || !value) return 0;
+    if (key_len >= sizeof ws_headers / sizeof ws_headers[0] || !ws_headers[key_len].name ||
+        strncasecmp(key, ws_headers[key_len].name, key_len))
+        return 0;
+
+    flag = ws_headers[key_len].flag;
+    switch (flag) {
+    case WS_HEADER_VERSION:
+        valid = value_len == 2 && !memcmp(value, "13", 2);
+        break;
+    case WS_HEADER_UPGRADE:
+        valid = value_len == 9 && !strncasecmp(value, "websocket", 9);
+        break;
+    case WS_HEADER_CONNECTION:
+        valid = strncasestr(value, "Upgrade", value_len) != 0;
+        break;
+    case WS_HEADER_KEY:
+        valid = value_len == WS_KEY_LEN;
+        break;
+    case WS_HEADER_ACCEPT:
+        valid = value_len == WS_ACCEPT_LEN;
+        break;
+    default:
+        return flag;
     }
-    return 0;
+    if (!valid) {
+        *flags &= ~flag;
+        return 0;
+    }
+    *flags |= flag;
+    return flag;
 }
 
 #endif /* LIBWS_IMPLEMENTATION */
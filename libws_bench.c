@@ -0,0 +1,457 @@
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double seconds = 1.0;
+
+static void
+usage(void) {
+    printf("libws_bench is a single core micro benchmark for libws.\n");
+    printf("libws_bench version %s running on libws %d.%d.%d.\n\n", "0.0.0", 0, 2, 0);
+    printf("Usage: libws_bench [-t seconds] [mask] [parse] [utf8] [broadcast] [handshake]\n");
+    printf("       libws_bench --help\n\n");
+    printf(" -t : seconds to run every case. Defaults to 1.\n");
+    printf(" mask : unmask payloads with every masking kernel against the byte loop.\n");
+    printf(" parse : parse pipelined frames whole, with every header split across two reads,\n");
+    printf("         and in batches of 64 with libws__parser_execute_many().\n");
+    printf(" utf8 : unmask and validate text, in two passes against the fused kernels.\n");
+    printf(" broadcast : send a compressed message to many sessions, one by one against prepared once.\n");
+    printf(" handshake : compute Sec-WebSocket-Accept with every SHA-1 kernel, format the response\n");
+    printf("             and upgrade a whole session, one by one and in batches of 64.\n");
+    printf(" --help : display this message.\n");
+    printf("\nSee https://github.com/zhoukk/libws for more information.\n\n");
+    exit(0);
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the masking loop libws shipped before the kernels */
+__attribute__((noinline)) static void
+mask_byte(char *buff, const char *payload, uint64_t length, uint32_t key) {
+    uint64_t i;
+    char *mask = (char *)&key;
+    for (i = 0; i < length; i++)
+        buff[i] = payload[i] ^ mask[i % 4];
+}
+
+static double
+bench_mask_case(libws_mask_fn fn, char *buff, const char *payload, uint64_t length) {
+    uint64_t n = 0, total = 0;
+    double start, elapsed;
+
+    start = now();
+    do {
+        /* odd offsets keep the unaligned head and tail in the measure */
+        fn(buff + (n & 1), payload + (n & 3), length, 0x0d0c0b0a);
+        total += length;
+        n++;
+    } while ((n & 63) || (elapsed = now() - start) < seconds);
+    return total / elapsed / 1e9;
+}
+
+static void
+bench_mask(void) {
+    static const uint64_t sizes[] = {16, 64, 1024, 16384, 1 << 20};
+    char *buff, *payload;
+    size_t i, k;
+
+    buff = malloc((1 << 20) + 64);
+    payload = malloc((1 << 20) + 64);
+    for (i = 0; i < (1 << 20) + 64; i++)
+        payload[i] = (char)rand();
+
+    printf("mask: selected kernel %s, GB/s per core\n", libws__mask_impl());
+    printf("%-8s", "size");
+    printf(" %10s", "byte");
+    for (k = 0; k < sizeof mask_kernels / sizeof mask_kernels[0]; k++)
+        if (mask_supported(mask_kernels[k].name))
+            printf(" %10s", mask_kernels[k].name);
+    printf("\n");
+    for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        printf("%-8lu", (unsigned long)sizes[i]);
+        printf(" %10.2f", bench_mask_case(mask_byte, buff, payload, sizes[i]));
+        for (k = 0; k < sizeof mask_kernels / sizeof mask_kernels[0]; k++)
+            if (mask_supported(mask_kernels[k].name))
+                printf(" %10.2f", bench_mask_case(mask_kernels[k].fn, buff, payload, sizes[i]));
+        printf("\n");
+    }
+    free(buff);
+    free(payload);
+}
+
+/* split: 0 whole buffers, 1 headers split across two reads, -1 batches */
+static double
+bench_parse_case(char *buff, uint64_t size, int split) {
+    struct libws_parser p;
+    struct libws_frame f, many[64];
+    struct libws_b b;
+    uint64_t frames = 0;
+    double start, elapsed;
+    int n = 0;
+
+    libws__parser_init(&p);
+    libws__parser_mode(&p, WS_PARSER_INPLACE);
+    start = now();
+    do {
+        b.data = buff;
+        b.length = size;
+        if (split < 0) {
+            int m;
+            while ((m = libws__parser_execute_many(&p, &b, many, 64)) > 0)
+                frames += m;
+            continue;
+        }
+        while (b.length) {
+            struct libws_b piece = b;
+            /* one byte first, the rest of the header straddles two reads */
+            if (split) piece.length = 1;
+            while (libws__parser_execute(&p, &piece, &f) > 0)
+                frames++;
+            b.length -= piece.data - b.data;
+            b.data = piece.data;
+            if (split && b.length) {
+                piece = b;
+                while (libws__parser_execute(&p, &piece, &f) > 0)
+                    frames++;
+                b.length -= piece.data - b.data;
+                b.data = piece.data;
+            }
+        }
+    } while ((++n & 15) || (elapsed = now() - start) < seconds);
+    return frames / elapsed / 1e6;
+}
+
+static void
+bench_parse(void) {
+    static const uint64_t sizes[] = {8, 31, 32, 60, 1024};
+    char payload[1024];
+    char *buff;
+    size_t i;
+
+    memset(payload, 'x', sizeof payload);
+    buff = malloc(1 << 20);
+    printf("parse: masked frames pipelined in 1MB, Mframes/s per core\n");
+    printf("%-8s %10s %10s %10s\n", "size", "whole", "split", "many");
+    for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        struct libws_b pl = {payload, sizes[i]};
+        uint64_t fsize = libws__build_size(1, sizes[i]), size = 0;
+        int flags = 0;
+
+        WS_BUILD_OPCODE(flags, WS_OPCODE_BINARY);
+        WS_BUILD_FIN(flags);
+        WS_BUILD_MASK(flags);
+        while (size + fsize <= (1 << 20)) {
+            libws__build(buff + size, flags, &pl);
+            size += fsize;
+        }
+        printf("%-8lu", (unsigned long)sizes[i]);
+        printf(" %10.2f", bench_parse_case(buff, size, 0));
+        printf(" %10.2f", bench_parse_case(buff, size, 1));
+        printf(" %10.2f\n", bench_parse_case(buff, size, -1));
+    }
+    free(buff);
+}
+
+/* fused 0 unmask then validate, 1 libws__mask_utf8() */
+static double
+bench_utf8_case(char *buff, const char *payload, uint64_t length, int fused) {
+    static const char mask[4] = {0x0a, 0x0b, 0x0c, 0x0d};
+    uint64_t n = 0, total = 0;
+    uint32_t state;
+    double start, elapsed;
+
+    start = now();
+    do {
+        state = WS_UTF8_ACCEPT;
+        if (fused) {
+            libws__mask_utf8(buff, mask, payload, length, 0, &state);
+        } else {
+            /* the same validation over the unmasked copy, xor with zero */
+            libws__mask(buff, mask, payload, length, 0);
+            libws__mask_utf8(buff, "\0\0\0\0", buff, length, 0, &state);
+        }
+        if (state != WS_UTF8_ACCEPT) {
+            fprintf(stderr, "Error: invalid utf-8 in the benchmark text.\n");
+            exit(1);
+        }
+        total += length;
+        n++;
+    } while ((n & 63) || (elapsed = now() - start) < seconds);
+    return total / elapsed / 1e9;
+}
+
+static void
+bench_utf8(void) {
+    static const char mask[4] = {0x0a, 0x0b, 0x0c, 0x0d};
+    static const uint64_t sizes[] = {64, 1024, 16384, 1 << 20};
+    /* one 3 bytes character in every 64 bytes, and all 3 bytes characters */
+    static const char *texts[] = {"ascii", "mixed", "cjk"};
+    char *buff, *payload;
+    size_t i, t;
+
+    buff = malloc(1 << 20);
+    payload = malloc(1 << 20);
+    printf("utf8: selected kernel %s, GB/s per core\n", libws__mask_impl());
+    printf("%-8s %-6s %10s %10s\n", "size", "text", "two-pass", "fused");
+    for (t = 0; t < sizeof texts / sizeof texts[0]; t++) {
+        for (i = 0; i < (1 << 20); i++)
+            payload[i] = 'a' + i % 26;
+        for (i = 0; t && i + 3 <= (1 << 20); i += t == 1 ? 64 : 3)
+            memcpy(payload + i, "\xe4\xb8\xad", 3);
+        libws__mask(payload, mask, payload, 1 << 20, 0);
+        for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+            /* cut the cjk text on a character */
+            uint64_t length = t == 2 ? sizes[i] - sizes[i] % 3 : sizes[i];
+            printf("%-8lu %-6s", (unsigned long)sizes[i], texts[t]);
+            printf(" %10.2f", bench_utf8_case(buff, payload, length, 0));
+            printf(" %10.2f\n", bench_utf8_case(buff, payload, length, 1));
+        }
+    }
+    free(buff);
+    free(payload);
+}
+
+static int
+bench_write(void *io, const char *data, int size) {
+    (void)io;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+static void
+bench_close(void *io) {
+    (void)io;
+}
+
+/* prepared 0 libwshttp__write() to every session, 1 libwshttp__prepare() once */
+static double
+bench_broadcast_case(struct libwshttp **wh, int n, struct libws_b *payload, int prepared) {
+    uint64_t m = 0;
+    double start, elapsed;
+    int i;
+
+    start = now();
+    do {
+        if (prepared) {
+            struct libwshttp_prepared *pm = libwshttp__prepare(0, WS_OPCODE_TEXT, payload, 15);
+            for (i = 0; i < n; i++)
+                libwshttp__write_prepared(wh[i], pm);
+            libwshttp__prepared_release(pm);
+        } else {
+            for (i = 0; i < n; i++)
+                libwshttp__write(wh[i], WS_OPCODE_TEXT, payload);
+        }
+        m++;
+    } while ((elapsed = now() - start) < seconds);
+    return elapsed / m * 1e6;
+}
+
+static void
+bench_broadcast(void) {
+    static const int counts[] = {1, 10, 100, 1000};
+    struct libwshttp *wh[1000];
+    char payload[1024];
+    struct libws_b b = {payload, sizeof payload};
+    size_t i;
+    int n;
+
+    for (n = 0; n < (int)sizeof payload; n += 32)
+        snprintf(payload + n, sizeof payload - n + 1, "{\"id\":%06d,\"price\":%08d}  ", n, n * 7);
+    /* sessions as after a handshake which agreed permessage-deflate without server context takeover */
+    for (n = 0; n < 1000; n++) {
+        wh[n] = libwshttp__create(1, 0, bench_write, bench_close);
+        wh[n]->handshake = 1;
+        wh[n]->pmd = 2;
+        wh[n]->pmd_d.server_no_context_takeover = 1;
+    }
+    printf("broadcast: 1KB json compressed, microseconds per message\n");
+    printf("%-8s %10s %10s\n", "sessions", "write", "prepared");
+    for (i = 0; i < sizeof counts / sizeof counts[0]; i++) {
+        printf("%-8d", counts[i]);
+        printf(" %10.2f", bench_broadcast_case(wh, counts[i], &b, 0));
+        printf(" %10.2f\n", bench_broadcast_case(wh, counts[i], &b, 1));
+    }
+    for (n = 0; n < 1000; n++)
+        libwshttp__destroy(wh[n]);
+}
+
+static const char *handshake_request =
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Origin: http://example.com\r\n"
+    "Sec-WebSocket-Protocol: chat\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static void
+bench_wait(void *io, int on) {
+    (void)io;
+    (void)on;
+}
+
+static int
+bench_writev(void *io, const struct libws_b *b, int n) {
+    int i, total = 0;
+    (void)io;
+    for (i = 0; i < n; i++)
+        total += (int)b[i].length;
+    return total;
+}
+
+/* what 0 accept only, 1 accept and response, 2 a session fed the request, batches of 64 with many */
+static double
+bench_handshake_case(int what, int many) {
+    static char keys[64][WS_KEY_LEN + 1], accepts[64][WS_ACCEPT_LEN];
+    struct libwshttp *wh[64];
+    const char *key[64];
+    char *accept[64];
+    char response[256];
+    uint64_t n = 0;
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        memcpy(keys[i], "dGhlIHNhbXBsZSBub25jZQ==", WS_KEY_LEN);
+        keys[i][i % 22] = 'A' + i % 26;
+        key[i] = keys[i];
+        accept[i] = accepts[i];
+    }
+    start = now();
+    do {
+        if (many && what < 2) {
+            libws__generate_accept_many(accept, key, 64);
+            for (i = 0; what == 1 && i < 64; i++)
+                libws__response_accept(response, sizeof response, "libws", "chat", 0, accept[i]);
+            n += 64;
+            continue;
+        } else if (many) {
+            for (i = 0; i < 64; i++) {
+                struct libws_b b = {(char *)handshake_request, strlen(handshake_request)};
+                struct libwshttp_event evt;
+                wh[i] = libwshttp__create(1, 0, bench_write, bench_close);
+                libwshttp__set_writev(wh[i], bench_writev);
+                libwshttp__set_queue(wh[i], bench_wait);
+                libwshttp__set_mode(wh[i], LIBWSHTTP_MODE_BATCH_ACCEPT);
+                if (libwshttp__feed(wh[i], &b, &evt) != 1 || evt.event != LIBWSHTTP_OPEN) {
+                    fprintf(stderr, "Error: the benchmark handshake failed.\n");
+                    exit(1);
+                }
+            }
+            libwshttp__accept_many(wh, 64);
+            for (i = 0; i < 64; i++) {
+                libwshttp__flush(wh[i]);
+                libwshttp__destroy(wh[i]);
+            }
+            n += 64;
+            continue;
+        }
+        /* a different key every time */
+        keys[0][n % 22] = 'A' + n % 26;
+        if (what == 0) {
+            libws__generate_accept(accepts[0], keys[0]);
+        } else if (what == 1) {
+            libws__response(response, sizeof response, "libws", "chat", 0, keys[0], accepts[0]);
+        } else {
+            struct libwshttp *wh = libwshttp__create(1, 0, bench_write, bench_close);
+            struct libws_b b = {(char *)handshake_request, strlen(handshake_request)};
+            struct libwshttp_event evt;
+            if (libwshttp__feed(wh, &b, &evt) != 1 || evt.event != LIBWSHTTP_OPEN) {
+                fprintf(stderr, "Error: the benchmark handshake failed.\n");
+                exit(1);
+            }
+            libwshttp__destroy(wh);
+        }
+        n++;
+    } while ((n & 63) || (elapsed = now() - start) < seconds);
+    return n / elapsed / 1e6;
+}
+
+static void
+bench_handshake(void) {
+    int selected, k;
+
+    printf("handshake: selected SHA-1 kernel %s, batches with %s, Mhandshakes/s per core\n", libws__sha1_impl(),
+           libws__sha1_many_impl(0));
+    printf("%-10s %10s %10s %10s\n", "kernel", "accept", "response", "session");
+    selected = sha1_kernel;
+    for (k = 0; k < (int)(sizeof sha1_kernels / sizeof sha1_kernels[0]); k++) {
+        if (!sha1_supported(sha1_kernels[k].name))
+            continue;
+        sha1_kernel = k;
+        printf("%-10s", sha1_kernels[k].name);
+        printf(" %10.2f", bench_handshake_case(0, 0));
+        printf(" %10.2f", bench_handshake_case(1, 0));
+        printf(" %10.2f\n", bench_handshake_case(2, 0));
+    }
+    sha1_kernel = selected;
+    /* in batches of 64, as a server answers the upgrades of a loop iteration */
+    selected = sha1_many_kernel;
+    for (k = 0; k < (int)(sizeof sha1_many_kernels / sizeof sha1_many_kernels[0]); k++) {
+        char name[32];
+        if (!sha1_many_supported(sha1_many_kernels[k].name))
+            continue;
+        sha1_many_kernel = k;
+        snprintf(name, sizeof name, "%s x%d", sha1_many_kernels[k].name, sha1_many_kernels[k].lanes);
+        printf("%-10s", name);
+        printf(" %10.2f", bench_handshake_case(0, 1));
+        printf(" %10.2f", bench_handshake_case(1, 1));
+        printf(" %10.2f\n", bench_handshake_case(2, 1));
+    }
+    sha1_many_kernel = selected;
+}
+
+int
+main(int argc, char *argv[]) {
+    int i, all = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage();
+        } else if (!strcmp(argv[i], "-t")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -t argument given but no seconds specified.\n\n");
+                usage();
+            }
+            seconds = atof(argv[++i]);
+        }
+    }
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "mask")) {
+            bench_mask();
+            all = 0;
+        } else if (!strcmp(argv[i], "parse")) {
+            bench_parse();
+            all = 0;
+        } else if (!strcmp(argv[i], "utf8")) {
+            bench_utf8();
+            all = 0;
+        } else if (!strcmp(argv[i], "broadcast")) {
+            bench_broadcast();
+            all = 0;
+        } else if (!strcmp(argv[i], "handshake")) {
+            bench_handshake();
+            all = 0;
+        }
+    }
+    if (all) {
+        bench_mask();
+        bench_parse();
+        bench_utf8();
+        bench_broadcast();
+        bench_handshake();
+    }
+    return 0;
+}
@@ -7,8 +7,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <signal.h>
 
 struct ae_io {
+    aeEventLoop *el;
     int fd;
     struct libwshttp *wh;
 };
@@ -26,6 +29,7 @@ static char *host = 0;
 static int port = 8080;
 static int debug = 0;
 static int quiet = 0;
+static int permessage_deflate = 0;
 static int pub_mode = MSGMODE_NONE;
 
 static char *payload = 0;
@@ -40,7 +44,7 @@ usage(void) {
     printf("libws_client is a simple websocket client that will send a message to server and exit.\n");
     printf("libws_client version %s running on libws %d.%d.%d.\n\n", "0.0.0", 0, 2, 0);
     printf("Usage: libws_client [-h host] [-p port] [-u url] [-P protocol] {-f file | -l | -n | -m message}\n");
-    printf("                     [-d] [--quiet]\n");
+    printf("                     [-z] [-d] [--quiet]\n");
     printf("       libws_client --help\n\n");
     printf(" -d : enable debug messages.\n");
     printf(" -f : send the contents of a file as the message.\n");
@@ -51,6 +55,7 @@ usage(void) {
     printf(" -m : message payload to send.\n");
     printf(" -p : network port to connect to. Defaults to 8080.\n");
     printf(" -s : read message from stdin, sending the entire input as a message.\n");
+    printf(" -z : compress messages with permessage-deflate when the peer agrees.\n");
     printf(" --help : display this message.\n");
     printf(" --quiet : don't print error messages.\n");
     printf("\nSee https://github.com/zhoukk/libws for more information.\n\n");
@@ -134,6 +139,8 @@ config(int argc, char *argv[]) {
                 pub_mode = MSGMODE_CMD;
             }
             i++;
+        } else if (!strcmp(argv[i], "-z") || !strcmp(argv[i], "--deflate")) {
+            permessage_deflate = 1;
         } else if (!strcmp(argv[i], "--quiet")) {
             quiet = 1;
         } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stdin-file")) {
@@ -244,7 +251,7 @@ load_file(void) {
 static void
 __close(aeEventLoop *el, struct ae_io *io) {
     if (AE_ERR != io->fd) {
-        aeDeleteFileEvent(el, io->fd, AE_READABLE);
+        aeDeleteFileEvent(el, io->fd, AE_READABLE | AE_WRITABLE);
         close(io->fd);
     }
     libwshttp__destroy(io->wh);
@@ -278,10 +285,11 @@ __read(aeEventLoop *el, int fd, void *privdata, int mask) {
     while ((rc = libwshttp__feed(io->wh, &b, &evt)) > 0) {
         if (evt.event == LIBWSHTTP_OPEN) {
             struct libws_b b = {.data = payload, .length = length};
+            if (debug)
+                fprintf(stdout, "open, extensions:%s\n", io->wh->pmd == 2 ? "permessage-deflate" : "none");
             libwshttp__write(io->wh, WS_OPCODE_BINARY, &b);
         } else if (evt.event == LIBWSHTTP_DATA) {
             fprintf(stdout, "opcode:%d, payload:%.*s\n", evt.f.opcode, (int)evt.f.payload.length, evt.f.payload.data);
-            free(evt.f.payload.data);
             libwshttp__close(io->wh, WS_STATUS_NORMAL, "byebye");
         } else if (evt.event == LIBWSHTTP_CLOSE) {
             if (evt.f.payload.length) {
@@ -290,12 +298,27 @@ __read(aeEventLoop *el, int fd, void *privdata, int mask) {
                 fprintf(stdout, "opcode:%d\n", evt.f.opcode);
             }
         }
+        libwshttp__free(io->wh, &evt);
     }
-    if (rc) {
+    /* a failed session closes once its close frame is out */
+    if (rc && !libwshttp__pending(io->wh)) {
         shutdown(fd, SHUT_WR);
     }
 }
 
+static void
+__write(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io *io;
+    (void)fd;
+    (void)mask;
+
+    io = (struct ae_io *)privdata;
+    if (libwshttp__flush(io->wh) < 0) {
+        __close(el, io);
+        aeStop(el);
+    }
+}
+
 static int
 _write(void *inst, const char *data, int size) {
     struct ae_io *io;
@@ -304,6 +327,36 @@ _write(void *inst, const char *data, int size) {
     return size == anetWrite(io->fd, (char *)data, size) ? 0 : -1;
 }
 
+static int
+_writev(void *inst, const struct libws_b *b, int n) {
+    struct ae_io *io;
+    struct iovec iov[n];
+    ssize_t nwritten;
+    int i;
+
+    io = (struct ae_io *)inst;
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = b[i].data;
+        iov[i].iov_len = b[i].length;
+    }
+    nwritten = writev(io->fd, iov, n);
+    if (nwritten == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    return (int)nwritten;
+}
+
+static void
+_wait(void *inst, int on) {
+    struct ae_io *io;
+
+    io = (struct ae_io *)inst;
+    if (!on) {
+        aeDeleteFileEvent(io->el, io->fd, AE_WRITABLE);
+    } else if (aeCreateFileEvent(io->el, io->fd, AE_WRITABLE, __write, io) == AE_ERR) {
+        if (!quiet) fprintf(stderr, "aeCreateFileEvent AE_WRITABLE __write fail\n");
+    }
+}
+
 static void
 _close(void *inst) {
     struct ae_io *io;
@@ -335,8 +388,16 @@ __connect(aeEventLoop *el, char *host, int port) {
         goto e2;
     }
 
+    io->el = el;
     io->fd = fd;
     io->wh = libwshttp__create(0, io, _write, _close);
+    libwshttp__set_writev(io->wh, _writev);
+    libwshttp__set_queue(io->wh, _wait);
+    libwshttp__set_mode(io->wh, LIBWSHTTP_MODE_INPLACE | LIBWSHTTP_MODE_MESSAGE | LIBWSHTTP_MODE_UTF8);
+    if (permessage_deflate) {
+        struct libws_deflate d = {0, 0, 0, 0};
+        libwshttp__set_deflate(io->wh, &d);
+    }
     libwshttp__request(io->wh, url, host, protocol);
     return io;
 
@@ -349,6 +410,7 @@ e1:
 int
 main(int argc, char *argv[]) {
     config(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
     if (!host) {
         host = strdup("127.0.0.1");
     }
@@ -3,34 +3,119 @@
 
 #include "lib/ae.h"
 #include "lib/anet.h"
+#include "lib/zmalloc.h"
 
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/** the place of a connection in a list of the loop */
+struct ae_link {
+    struct ae_io *prev;
+    struct ae_io *next;
+    int on;
+};
+
+#define AE_LIST_DIRTY 0     /* connections with replies to flush before sleep */
+#define AE_LIST_ACCEPT 1    /* connections whose upgrade requests are answered before sleep */
+#define AE_LIST_READ 2      /* edge triggered connections with input left over the read budget */
 
 struct ae_io {
+    aeEventLoop *el;
     int fd;
     struct libwshttp *wh;
+    struct ae_link link[3];
+    int failed;     /* no more reads, closed once the queue is out */
+    int completion; /* io_uring receives and sends for it */
+};
+
+#define AE_LOOP_QUEUE 4096  /* connections handed to a loop not taken yet, a power of 2 */
+#define AE_LOOP_WINDOW 100  /* milliseconds over which the busy time of a loop is measured */
+#define AE_MAX_SETSIZE (1024 * 1024)  /* fds of a loop without a limit of open files */
+#define AE_SEND_LIMIT (256 * 1024)    /* bytes a connection has queued with io_uring before it waits */
+
+/** an I/O loop fed with connections by the acceptor thread */
+struct ae_loop {
+    pthread_t thread;
+    int rfd, wfd;               /* wakeup, an eventfd or a pipe */
+    int fds[AE_LOOP_QUEUE];     /* single producer single consumer ring */
+    unsigned head;              /* taken by the loop */
+    unsigned tail;              /* handed by the acceptor */
+    int wake;                   /* the acceptor has to wake it up */
+    int connections;            /* handed and not closed yet */
+    int busy;                   /* permille of the last window out of poll */
+    long long busy_us;          /* of the loop only */
 };
 
 static char *host = 0;
 static int port = 8080;
 static int debug = 0;
 static int quiet = 0;
+static int permessage_deflate = 0;
+static size_t deflate_budget = 64 << 20;
+static __thread struct libwshttp_zpool *zpool = 0;
+static uint64_t max_message = 268435455;
+static int coalesce = 0;
+static int edge = 0;
+static size_t read_budget = 256 << 10;
+static int threads = 1;
+static int acceptor = 0;
+static char *api = 0;
+static struct ae_loop *loops = 0;
+/* each thread runs its own loop with its own lists and zlib pool */
+static __thread struct ae_io *lists[3] = {0, 0, 0};
+static __thread struct ae_loop *loop = 0;
 
 static char *server = 0;
 
+static void *
+_alloc(void *ud, size_t size) {
+    (void)ud;
+    return zmalloc(size);
+}
+
+static void *
+_realloc(void *ud, void *ptr, size_t size) {
+    (void)ud;
+    return zrealloc(ptr, size);
+}
+
+static void
+_free(void *ud, void *ptr) {
+    (void)ud;
+    zfree(ptr);
+}
+
+static const struct libws_allocator allocator = {_alloc, _realloc, _free, 0};
+
 static void
 usage(void) {
     printf("libws_server is a simple websocket server.\n");
     printf("libws_server version %s running on libws %d.%d.%d.\n\n", "0.0.0", 0, 2, 0);
-    printf("Usage: libws_server [-h host] [-p port] [-s server]\n");
-    printf("                     [-d] [--quiet]\n");
+    printf("Usage: libws_server [-h host] [-p port] [-s server] [-m max]\n");
+    printf("                     [-z] [-b budget] [-c] [-e] [-r budget] [-t threads]\n");
+    printf("                     [-a] [-u] [-d] [--quiet]\n");
     printf("       libws_server --help\n\n");
     printf(" -d : enable debug messages.\n");
     printf(" -h : http host to connect to. Defaults to localhost.\n");
     printf(" -s : server for websocket. Defaults libws.\n");
     printf(" -p : network port to connect to. Defaults to 8080.\n");
+    printf(" -m : max message size in bytes. Defaults to 268435455.\n");
+    printf(" -z : compress messages with permessage-deflate when the peer agrees.\n");
+    printf(" -b : zlib memory budget of all connections in bytes. Defaults to 67108864.\n");
+    printf(" -c : coalesce the replies of a connection into one write per event loop iteration.\n");
+    printf(" -e : edge triggered events with epoll, each connection read until EAGAIN.\n");
+    printf(" -r : bytes read from a connection per event loop iteration. Defaults to 262144.\n");
+    printf(" -t : event loop threads, each listening on the port with SO_REUSEPORT. Defaults to 1.\n");
+    printf(" -a : with -t, one more thread accepts and hands each connection to the least loaded loop.\n");
+    printf(" -u : event loops with io_uring in place of %s, which accepts, receives and sends itself.\n", aeGetApiName());
     printf(" --help : display this message.\n");
     printf(" --quiet : don't print error messages.\n");
     printf("\nSee https://github.com/zhoukk/libws for more information.\n\n");
@@ -74,6 +159,56 @@ config(int argc, char *argv[]) {
                 server = strdup(argv[i+1]);
             }
             i++;
+        } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--max-message")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -m argument given but no size specified.\n\n");
+                goto e;
+            } else {
+                max_message = strtoull(argv[i+1], 0, 10);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-z") || !strcmp(argv[i], "--deflate")) {
+            permessage_deflate = 1;
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--deflate-budget")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -b argument given but no budget specified.\n\n");
+                goto e;
+            } else {
+                deflate_budget = strtoull(argv[i+1], 0, 10);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--coalesce")) {
+            coalesce = 1;
+        } else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--edge")) {
+            edge = 1;
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--read-budget")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -r argument given but no budget specified.\n\n");
+                goto e;
+            } else {
+                read_budget = strtoull(argv[i+1], 0, 10);
+                if (!read_budget) {
+                    fprintf(stderr, "Error: Invalid read budget given: %s\n", argv[i+1]);
+                    goto e;
+                }
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -t argument given but no threads specified.\n\n");
+                goto e;
+            } else {
+                threads = atoi(argv[i+1]);
+                if (threads < 1 || threads > 1024) {
+                    fprintf(stderr, "Error: Invalid threads given: %d\n", threads);
+                    goto e;
+                }
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--acceptor")) {
+            acceptor = 1;
+        } else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--io-uring")) {
+            api = "io_uring";
         } else if (!strcmp(argv[i], "--quiet")) {
             quiet = 1;
         } else {
@@ -88,46 +223,67 @@ e:
     exit(0);
 }
 
+static void
+__link(struct ae_io *io, int list, int on) {
+    struct ae_link *l = &io->link[list];
+
+    if (l->on == on) return;
+    l->on = on;
+    if (on) {
+        l->prev = 0;
+        l->next = lists[list];
+        if (lists[list]) lists[list]->link[list].prev = io;
+        lists[list] = io;
+    } else {
+        if (l->prev) l->prev->link[list].next = l->next;
+        else lists[list] = l->next;
+        if (l->next) l->next->link[list].prev = l->prev;
+    }
+}
+
 static void
 __close(aeEventLoop *el, struct ae_io *io) {
+    __link(io, AE_LIST_DIRTY, 0);
+    __link(io, AE_LIST_ACCEPT, 0);
+    __link(io, AE_LIST_READ, 0);
     if (AE_ERR != io->fd) {
-        aeDeleteFileEvent(el, io->fd, AE_READABLE);
+        if (io->completion)
+            aeDeleteCompletionEvents(el, io->fd);
+        aeDeleteFileEvent(el, io->fd, AE_READABLE | AE_WRITABLE);
         close(io->fd);
     }
     libwshttp__destroy(io->wh);
     free(io);
+    if (loop) __atomic_sub_fetch(&loop->connections, 1, __ATOMIC_RELAXED);
+    if (debug) fprintf(stdout, "__close used memory %zu\n", zmalloc_used_memory());
+    if (debug && zpool) fprintf(stdout, "__close zlib memory %zu\n", libwshttp__zpool_used(zpool));
 }
 
-static void
-__read(aeEventLoop *el, int fd, void *privdata, int mask) {
-    struct ae_io *io;
-    int nread;
-    char buff[4096];
+/** nothing left to write, in the session or queued with io_uring */
+static int
+__drained(struct ae_io *io) {
+    return !libwshttp__pending(io->wh) && (!io->completion || !aeSendPending(io->el, io->fd));
+}
+
+/**
+ * feed what was read to the session, return -1 once it failed; a failed
+ * session reads no more, it closes once its close frame is out
+ */
+static int
+__feed(aeEventLoop *el, struct ae_io *io, char *buff, size_t n) {
     struct libws_b b;
     struct libwshttp_event evt;
     int rc;
-    (void)mask;
-
-    io = (struct ae_io *)privdata;
-    nread = read(fd, buff, sizeof(buff));
-    if (nread == -1 && errno == EAGAIN) {
-        return;
-    }
-    if (nread <= 0) {
-        __close(el, io);
-        return;
-    }
 
     b.data = buff;
-    b.length = nread;
+    b.length = n;
 
     while ((rc = libwshttp__feed(io->wh, &b, &evt)) > 0) {
         if (evt.event == LIBWSHTTP_OPEN) {
-
+            __link(io, AE_LIST_ACCEPT, 1);
         } else if (evt.event == LIBWSHTTP_DATA) {
             fprintf(stdout, "opcode:%d, payload:%.*s\n", evt.f.opcode, (int)evt.f.payload.length, evt.f.payload.data);
             libwshttp__write(io->wh, WS_OPCODE_BINARY, &evt.f.payload);
-            free(evt.f.payload.data);
         } else if (evt.event == LIBWSHTTP_CLOSE) {
             if (evt.f.payload.length) {
                 fprintf(stdout, "opcode:%d, status:%d, reason:%.*s\n", evt.f.opcode, WS_CLOSE_STATUS(evt.f.payload), WS_CLOSE_REASON_LEN(evt.f.payload), WS_CLOSE_REASON(evt.f.payload));
@@ -135,10 +291,89 @@ __read(aeEventLoop *el, int fd, void *privdata, int mask) {
                 fprintf(stdout, "opcode:%d\n", evt.f.opcode);
             }
         }
+        libwshttp__free(io->wh, &evt);
     }
     if (rc) {
-        shutdown(fd, SHUT_WR);
+        if (__drained(io)) {
+            __close(el, io);
+        } else {
+            io->failed = 1;
+            if (io->completion)
+                aeDeleteRecvEvent(el, io->fd);
+            else
+                aeDeleteFileEvent(el, io->fd, AE_READABLE);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * read until EAGAIN, at most read_budget bytes so that a busy peer can't
+ * starve the others; an edge triggered connection stopped by the budget
+ * is read again before sleep as it won't be reported again
+ */
+static void
+__read(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io *io;
+    ssize_t nread;
+    size_t budget = read_budget;
+    char buff[16384];
+    (void)mask;
+
+    io = (struct ae_io *)privdata;
+    __link(io, AE_LIST_READ, 0);
+    for (;;) {
+        if (!budget) {
+            if (edge) __link(io, AE_LIST_READ, 1);
+            return;
+        }
+        nread = read(fd, buff, budget < sizeof(buff) ? budget : sizeof(buff));
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && errno == EAGAIN) {
+            return;
+        }
+        if (nread <= 0) {
+            __close(el, io);
+            return;
+        }
+        budget -= nread;
+
+        if (__feed(el, io, buff, nread) < 0) {
+            return;
+        }
+        /* a short read emptied the socket, no need for the EAGAIN */
+        if ((size_t)nread < sizeof(buff) && budget) {
+            return;
+        }
+    }
+}
+
+/** what io_uring received for a connection, in a buffer of the loop */
+static void
+__recv(aeEventLoop *el, int fd, void *privdata, char *buf, int nread) {
+    struct ae_io *io;
+    (void)fd;
+
+    io = (struct ae_io *)privdata;
+    if (nread <= 0) {
+        __close(el, io);
+        return;
     }
+    __feed(el, io, buf, nread);
+}
+
+static void
+__write(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io *io;
+    (void)fd;
+    (void)mask;
+
+    io = (struct ae_io *)privdata;
+    if (libwshttp__flush(io->wh) < 0 || (io->failed && __drained(io)))
+        __close(el, io);
 }
 
 static int
@@ -146,15 +381,139 @@ _write(void *inst, const char *data, int size) {
     struct ae_io *io;
 
     io = (struct ae_io *)inst;
+    if (io->completion) {
+        struct iovec iov = {(char *)data, (size_t)size};
+
+        return aeSend(io->el, io->fd, &iov, 1) == AE_OK ? 0 : -1;
+    }
     return size == anetWrite(io->fd, (char *)data, size) ? 0 : -1;
 }
 
+static int
+_writev(void *inst, const struct libws_b *b, int n) {
+    struct ae_io *io;
+    struct iovec iov[n];
+    ssize_t nwritten;
+    uint64_t total;
+    int i;
+
+    io = (struct ae_io *)inst;
+    total = 0;
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = b[i].data;
+        iov[i].iov_len = b[i].length;
+        total += b[i].length;
+    }
+    if (total > INT_MAX)
+        return -1;
+    if (io->completion) {
+        /* what the kernel has not sent yet holds the rest back */
+        if (aeSendPending(io->el, io->fd) >= AE_SEND_LIMIT)
+            return 0;
+        return aeSend(io->el, io->fd, iov, n) == AE_OK ? (int)total : -1;
+    }
+    nwritten = writev(io->fd, iov, n);
+    if (nwritten == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    return (int)nwritten;
+}
+
+static void
+_wait(void *inst, int on) {
+    struct ae_io *io;
+
+    io = (struct ae_io *)inst;
+    if (!on) {
+        aeDeleteFileEvent(io->el, io->fd, AE_WRITABLE);
+    } else if (coalesce) {
+        __link(io, AE_LIST_DIRTY, 1);
+    } else if (io->completion) {
+        /* flushed by __sent */
+    } else if (aeCreateFileEvent(io->el, io->fd, AE_WRITABLE, __write, io) == AE_ERR) {
+        if (!quiet) fprintf(stderr, "aeCreateFileEvent AE_WRITABLE __write fail\n");
+    }
+}
+
+static void
+__flush(aeEventLoop *el, struct ae_io *io) {
+    int rc;
+
+    rc = libwshttp__flush(io->wh);
+    if (rc < 0 || (io->failed && __drained(io))) {
+        __close(el, io);
+    } else if (rc > 0 && !io->completion && aeCreateFileEvent(el, io->fd, AE_WRITABLE, __write, io) == AE_ERR) {
+        if (!quiet) fprintf(stderr, "aeCreateFileEvent AE_WRITABLE __write fail\n");
+    }
+}
+
+/** io_uring sent all that was queued on a connection, the session goes on */
+static void
+__sent(aeEventLoop *el, int fd, void *privdata, int err) {
+    struct ae_io *io;
+    (void)fd;
+
+    io = (struct ae_io *)privdata;
+    if (err < 0 || (io->failed && __drained(io)))
+        __close(el, io);
+    else if (libwshttp__pending(io->wh))
+        __flush(el, io);
+}
+
+/**
+ * the reads left over the budget, the upgrade requests of the iteration
+ * answered together, then one writev for all the replies of a connection,
+ * AE_WRITABLE only for what is left; an I/O loop counts the time of the
+ * iteration as busy
+ */
+static void
+__beforesleep(aeEventLoop *el) {
+    struct libwshttp *wh[LIBWSHTTP_ACCEPT_BATCH];
+    struct ae_io *io, *next, *batch[LIBWSHTTP_ACCEPT_BATCH];
+    int i, n;
+
+    /* one more budget each, those which use it up again are back in a new list */
+    io = lists[AE_LIST_READ];
+    lists[AE_LIST_READ] = 0;
+    for (; io; io = next) {
+        next = io->link[AE_LIST_READ].next;
+        io->link[AE_LIST_READ].on = 0;
+        __read(el, io->fd, io, AE_READABLE);
+    }
+    aeSetDontWait(el, lists[AE_LIST_READ] != 0);
+
+    while (lists[AE_LIST_ACCEPT]) {
+        for (n = 0; n < LIBWSHTTP_ACCEPT_BATCH && (io = lists[AE_LIST_ACCEPT]); n++) {
+            __link(io, AE_LIST_ACCEPT, 0);
+            batch[n] = io;
+            wh[n] = io->wh;
+        }
+        libwshttp__accept_many(wh, n);
+        for (i = 0; i < n; i++) {
+            if (!coalesce)
+                __flush(el, batch[i]);
+        }
+    }
+    while ((io = lists[AE_LIST_DIRTY])) {
+        __link(io, AE_LIST_DIRTY, 0);
+        __flush(el, io);
+    }
+    if (loop) {
+        long long start = aeGetTime(el);
+
+        aeUpdateTime(el);
+        loop->busy_us += aeGetTime(el) - start;
+    }
+}
+
 static void
 _close(void *inst) {
     struct ae_io *io;
 
     io = (struct ae_io *)inst;
-    shutdown(io->fd, SHUT_WR);
+    if (io->completion)
+        aeSendShutdown(io->el, io->fd);
+    else
+        shutdown(io->fd, SHUT_WR);
 }
 
 static void
@@ -170,15 +529,103 @@ __connection(aeEventLoop *el, int fd, char *ip) {
     anetEnableTcpNoDelay(0, fd);
     anetKeepAlive(0, fd, keepalive);
 
-    if (aeCreateFileEvent(el, fd, AE_READABLE, __read, io) == AE_ERR) {
+    /* io_uring receives and sends itself, when the kernel can */
+    if (aeCreateRecvEvent(el, fd, __recv, __sent, io) == AE_OK) {
+        io->completion = 1;
+    } else if (aeCreateFileEvent(el, fd, AE_READABLE | (edge ? AE_EDGE : 0), __read, io) == AE_ERR) {
         if (!quiet) fprintf(stderr, "aeCreateFileEvent AE_READABLE __read fail\n");
         close(fd);
         free(io);
+        if (loop) __atomic_sub_fetch(&loop->connections, 1, __ATOMIC_RELAXED);
         return;
     }
 
+    io->el = el;
     io->fd = fd;
-    io->wh = libwshttp__create(1, io, _write, _close);
+    io->wh = libwshttp__create_ex(1, io, _write, _close, &allocator);
+    libwshttp__set_writev(io->wh, _writev);
+    libwshttp__set_queue(io->wh, _wait);
+    libwshttp__set_mode(io->wh, LIBWSHTTP_MODE_INPLACE | LIBWSHTTP_MODE_MESSAGE | LIBWSHTTP_MODE_UTF8 |
+                                LIBWSHTTP_MODE_BATCH_ACCEPT | (coalesce ? LIBWSHTTP_MODE_COALESCE : 0));
+    libwshttp__set_limit(io->wh, 0, max_message);
+    if (permessage_deflate) {
+        struct libws_deflate d = {0, 0, 0, 0};
+        libwshttp__set_deflate(io->wh, &d);
+        libwshttp__set_zpool(io->wh, zpool);
+    }
+}
+
+/**
+ * the loop which is the least busy by steps of 10%, then with the fewest
+ * connections, and room in its queue
+ */
+static struct ae_loop *
+__pick(void) {
+    struct ae_loop *best = 0;
+    int i, load, best_load = 0;
+
+    for (i = 0; i < threads; i++) {
+        struct ae_loop *l = &loops[i];
+        unsigned head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+
+        if (l->tail - head == AE_LOOP_QUEUE) continue;
+        load = __atomic_load_n(&l->busy, __ATOMIC_RELAXED) / 100 * 1000000 +
+               __atomic_load_n(&l->connections, __ATOMIC_RELAXED);
+        if (!best || load < best_load) {
+            best = l;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static void
+__handoff(int fd) {
+    struct ae_loop *l = __pick();
+
+    if (!l) {
+        if (!quiet) fprintf(stderr, "__handoff all loops are full\n");
+        close(fd);
+        return;
+    }
+    if (debug) fprintf(stdout, "__handoff %d to loop %d\n", fd, (int)(l - loops));
+    __atomic_add_fetch(&l->connections, 1, __ATOMIC_RELAXED);
+    l->fds[l->tail & (AE_LOOP_QUEUE-1)] = fd;
+    __atomic_store_n(&l->tail, l->tail + 1, __ATOMIC_RELEASE);
+    l->wake = 1;
+}
+
+/** the connections handed by the acceptor, one wakeup for all of them */
+static void
+__wakeup(aeEventLoop *el, int fd, void *privdata, int mask) {
+    uint64_t v[16];
+    unsigned tail;
+    (void)privdata;
+    (void)mask;
+
+    if (read(fd, v, sizeof(v)) < 0 && errno != EAGAIN) {
+        if (!quiet) fprintf(stderr, "__wakeup read: %s\n", strerror(errno));
+    }
+    tail = __atomic_load_n(&loop->tail, __ATOMIC_ACQUIRE);
+    while (loop->head != tail) {
+        int cfd = loop->fds[loop->head & (AE_LOOP_QUEUE-1)];
+
+        __atomic_store_n(&loop->head, loop->head + 1, __ATOMIC_RELEASE);
+        __connection(el, cfd, 0);
+    }
+}
+
+/** the busy permille of the loop over the last window */
+static int
+__load(aeEventLoop *el, long long id, void *privdata) {
+    (void)el;
+    (void)id;
+    (void)privdata;
+
+    __atomic_store_n(&loop->busy, loop->busy_us < AE_LOOP_WINDOW * 1000 ? (int)(loop->busy_us / AE_LOOP_WINDOW) : 1000,
+                     __ATOMIC_RELAXED);
+    loop->busy_us = 0;
+    return AE_LOOP_WINDOW;
 }
 
 static void
@@ -195,33 +642,181 @@ __accept(aeEventLoop *el, int fd, void *privdata, int mask) {
         if (cfd == ANET_ERR) {
             if (errno != EWOULDBLOCK)
                 if (!quiet) fprintf(stderr, "anetTcpAccept: %s\n", neterr);
-            return;
+            break;
         }
         if (!quiet) fprintf(stdout, "__accept %s:%d\n", cip, cport);
-        __connection(el, cfd, cip);
+        if (loops)
+            __handoff(cfd);
+        else
+            __connection(el, cfd, cip);
+    }
+}
+
+/** a connection accepted by io_uring */
+static void
+__accepted(aeEventLoop *el, int fd, int cfd, void *privdata) {
+    int cport;
+    char cip[46];
+    (void)fd;
+    (void)privdata;
+
+    if (cfd < 0) {
+        if (!quiet) fprintf(stderr, "__accepted: %s\n", strerror(-cfd));
+        return;
+    }
+    if (!quiet && anetPeerToString(cfd, cip, sizeof cip, &cport) != -1)
+        fprintf(stdout, "__accept %s:%d\n", cip, cport);
+    if (loops)
+        __handoff(cfd);
+    else
+        __connection(el, cfd, 0);
+}
+
+/** the loops given connections by the acceptor in the iteration, one wakeup each */
+static void
+__wakeall(aeEventLoop *el) {
+    int i;
+    (void)el;
+
+    for (i = 0; i < threads; i++) {
+        uint64_t one = 1;
+
+        if (!loops[i].wake) continue;
+        loops[i].wake = 0;
+        if (write(loops[i].wfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            if (!quiet) fprintf(stderr, "__accept wakeup: %s\n", strerror(errno));
+        }
     }
 }
 
 static int
 __listen(aeEventLoop *el, char *host, int port) {
     char neterr[ANET_ERR_LEN];
-    int fd = anetTcpServer(neterr, port, host, 512);
+    int fd;
+
+    if (threads > 1 && !acceptor)
+        fd = anetTcpReusePortServer(neterr, port, host, 512);
+    else
+        fd = anetTcpServer(neterr, port, host, 512);
     if (fd == ANET_ERR) {
         fprintf(stderr, "anetTcpServer: %s\n", neterr);
         return -1;
     }
     anetNonBlock(0, fd);
-    if (aeCreateFileEvent(el, fd, AE_READABLE, __accept, 0) == AE_ERR) {
+    if (aeCreateAcceptEvent(el, fd, __accepted, 0) == AE_ERR &&
+        aeCreateFileEvent(el, fd, AE_READABLE, __accept, 0) == AE_ERR) {
         fprintf(stderr, "aeCreateFileEvent AE_READABLE __accept failed\n");
+        close(fd);
         return -1;
     }
     fprintf(stdout, "libws_server listen at %s:%d\n", host, port);
     return fd;
 }
 
+static aeEventLoop *
+__create(int setsize) {
+    aeEventLoop *el = aeCreateEventLoop(setsize);
+
+    if (el && api && aeSetApi(el, api) == AE_ERR) {
+        fprintf(stderr, "aeSetApi %s: %s\n", api, strerror(errno));
+        aeDeleteEventLoop(el);
+        return 0;
+    }
+    return el;
+}
+
+/**
+ * fds are numbered for the whole process and all of them are below
+ * RLIMIT_NOFILE, a loop of that size can take any connection
+ */
+static int
+__setsize(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > AE_MAX_SETSIZE)
+        return AE_MAX_SETSIZE;
+    return (int)rl.rlim_cur;
+}
+
+/**
+ * an event loop with its own listening socket, the kernel spreads the
+ * connections among the threads which share nothing else; or an I/O loop
+ * given its connections by the acceptor
+ */
+static void *
+__serve(void *arg) {
+    aeEventLoop *el;
+    int fd = ANET_ERR;
+
+    loop = (struct ae_loop *)arg;
+    if (permessage_deflate)
+        zpool = libwshttp__zpool_create(&allocator, deflate_budget / threads, 11);
+    el = __create(__setsize());
+    if (!el) {
+        goto e;
+    } else if (loop) {
+        if (aeCreateFileEvent(el, loop->rfd, AE_READABLE, __wakeup, 0) == AE_ERR ||
+            aeCreateTimeEvent(el, AE_LOOP_WINDOW, __load, 0, 0) == AE_ERR) {
+            fprintf(stderr, "__serve loop setup failed\n");
+            goto e;
+        }
+    } else if ((fd = __listen(el, host, port)) == ANET_ERR) {
+        goto e;
+    }
+    aeSetBeforeSleepProc(el, __beforesleep);
+    aeMain(el);
+    if (fd != ANET_ERR)
+        close(fd);
+e:
+    if (el)
+        aeDeleteEventLoop(el);
+    if (zpool)
+        libwshttp__zpool_destroy(zpool);
+    return 0;
+}
+
+static int
+__wakefd(struct ae_loop *l) {
+#ifdef __linux__
+    l->rfd = l->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return l->rfd;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1) return -1;
+    anetNonBlock(0, fds[0]);
+    anetNonBlock(0, fds[1]);
+    l->rfd = fds[0];
+    l->wfd = fds[1];
+    return 0;
+#endif
+}
+
+/** the listening socket in the main thread, the connections go to the loops */
+static void
+__acceptor(void) {
+    aeEventLoop *el;
+    int fd;
+
+    el = __create(__setsize());
+    if (!el)
+        return;
+    fd = __listen(el, host, port);
+    if (fd != ANET_ERR) {
+        aeSetBeforeSleepProc(el, __wakeall);
+        aeMain(el);
+        close(fd);
+    }
+    aeDeleteEventLoop(el);
+}
+
 int
 main(int argc, char *argv[]) {
+    pthread_t *tids;
+    int i, rc;
+
     config(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
     if (!host) {
         host = strdup("0.0.0.0");
     }
@@ -229,18 +824,32 @@ main(int argc, char *argv[]) {
         server = strdup("libws");
     }
 
-    aeEventLoop *el;
-    int fd;
-    el = aeCreateEventLoop(128);
-    fd = __listen(el, host, port);
-    if (fd == ANET_ERR) {
-        return 0;
+    if (threads == 1 && !acceptor) {
+        __serve(0);
+    } else {
+        zmalloc_enable_thread_safeness();
+        tids = malloc(sizeof(*tids) * threads);
+        if (acceptor)
+            loops = calloc(threads, sizeof(*loops));
+        /* the loops started run forever, a failed start exits with them */
+        for (i = 0; i < threads; i++) {
+            if (acceptor && __wakefd(&loops[i]) == -1) {
+                fprintf(stderr, "__wakefd: %s\n", strerror(errno));
+                exit(1);
+            }
+            if ((rc = pthread_create(&tids[i], 0, __serve, acceptor ? &loops[i] : 0))) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+                exit(1);
+            }
+        }
+        if (acceptor)
+            __acceptor();
+        while (i--)
+            pthread_join(tids[i], 0);
+        free(tids);
+        free(loops);
     }
 
-    aeMain(el);
-    aeDeleteEventLoop(el);
-    close(fd);
-
     free(host);
     free(server);
     return 0;
@@ -39,12 +39,32 @@ extern "C" {
 
 #define LIBWSHTTP_MAX_HTTP_LEN 4096
 #define LIBWSHTTP_MAX_PROTOCOL_LEN 16
+#define LIBWSHTTP_MAX_EXTENSIONS_LEN 256
 #define LIBWSHTTP_DEF_SERVER "libws"
+#define LIBWSHTTP_DEFLATE_LEVEL 6
+#define LIBWSHTTP_DEFLATE_MEMLEVEL 8
+#define LIBWSHTTP_DEFLATE_MIN_SIZE 64
+#define LIBWSHTTP_OUT_CHUNK (16 * 1024)
+#define LIBWSHTTP_OUT_IOV 64
+#define LIBWSHTTP_ACCEPT_BATCH 64
+#define LIBWSHTTP_OUT_FRAGMENT (16 * 1024)
 
 #define LIBWSHTTP_OPEN 1
 #define LIBWSHTTP_DATA 2
 #define LIBWSHTTP_CLOSE 3
 
+/** Session mode. */
+#define LIBWSHTTP_MODE_INPLACE 0x01
+#define LIBWSHTTP_MODE_STREAM 0x02
+#define LIBWSHTTP_MODE_MESSAGE 0x04
+#define LIBWSHTTP_MODE_UTF8 0x08
+#define LIBWSHTTP_MODE_COALESCE 0x10
+#define LIBWSHTTP_MODE_BATCH_ACCEPT 0x20
+
+#define LIBWSHTTP_PRIORITY_HIGH 1
+#define LIBWSHTTP_PRIORITY_NORMAL 2
+#define LIBWSHTTP_PRIORITY_LOW 3
+
 struct libwshttp_event {
     int event;
     struct libws_frame f;
@@ -52,28 +72,172 @@ struct libwshttp_event {
 
 struct libwshttp;
 
+struct libwshttp_zpool;
+
+struct libwshttp_prepared;
+
 /**
  *
  */
 extern LIBWSHTTP_API struct libwshttp *libwshttp__create(int issrv, void *io, int (*write)(void *io, const char *data, int size), void (*close)(void *io));
 
+/**
+ * create a session whose own memory and frame payloads come from allocator a,
+ * a must outlive the session
+ */
+extern LIBWSHTTP_API struct libwshttp *libwshttp__create_ex(int issrv, void *io, int (*write)(void *io, const char *data, int size), void (*close)(void *io),
+                                                            const struct libws_allocator *a);
+
 /**
  *
  *
  */
 extern LIBWSHTTP_API void libwshttp__destroy(struct libwshttp *wh);
 
+/**
+ * send frames with writev, writev writes the n buffers of b in order and returns the bytes
+ * written or -1 on error. unmasked frames are then sent as header and payload without a copy.
+ * a frame larger than INT_MAX is refused, the counts of write and writev are int.
+ */
+extern LIBWSHTTP_API void libwshttp__set_writev(struct libwshttp *wh, int (*writev)(void *io, const struct libws_b *b, int n));
+
+/**
+ * queue what a non-blocking io does not take at once, after libwshttp__set_writev().
+ * writev then writes what it can and returns the bytes written, 0 when io is full, or -1 on error.
+ * the rest is kept, and wait(io, 1) asks for libwshttp__flush() to be called whenever
+ * io is writable, until wait(io, 0) when the queue is empty.
+ * queued control frames go out first, at the next frame boundary, then data by priority,
+ * then the close frame. data messages are sent as frames of LIBWSHTTP_OUT_FRAGMENT bytes,
+ * so that control frames get in between, a message of another priority waits for the last one.
+ */
+extern LIBWSHTTP_API void libwshttp__set_queue(struct libwshttp *wh, void (*wait)(void *io, int on));
+
+/**
+ * write the queue out, return 0 when it is empty, 1 when io is full again, -1 on error
+ */
+extern LIBWSHTTP_API int libwshttp__flush(struct libwshttp *wh);
+
+/**
+ * bytes queued and not yet written, to find slow consumers
+ */
+extern LIBWSHTTP_API uint64_t libwshttp__pending(struct libwshttp *wh);
+
+/**
+ * set the session mode
+ *
+ * mode:
+ *      LIBWSHTTP_MODE_INPLACE - frames which are whole in the fed buffer are unmasked in place
+ *                               and delivered without a copy, see libws__parser_mode().
+ *      LIBWSHTTP_MODE_STREAM - data frames are delivered as LIBWSHTTP_DATA chunks as they arrive,
+ *                              with f.offset and f.remain, in constant memory.
+ *      LIBWSHTTP_MODE_MESSAGE - fragmented messages are reassembled and delivered as one
+ *                               LIBWSHTTP_DATA event with the opcode of the first fragment.
+ *                               control frames between fragments are delivered as they come.
+ *                               not used together with LIBWSHTTP_MODE_STREAM.
+ *      LIBWSHTTP_MODE_UTF8 - text messages are validated as UTF-8 while they are unmasked,
+ *                            the session is closed with WS_STATUS_INVALID_PAYLOAD on error.
+ *      LIBWSHTTP_MODE_COALESCE - with a queue, frames smaller than LIBWSHTTP_OUT_CHUNK are only
+ *                                queued, and wait(io, 1) comes with the first of them. the
+ *                                application flushes once per loop iteration, one writev for all.
+ *      LIBWSHTTP_MODE_BATCH_ACCEPT - with a queue, a server opens on the upgrade request but
+ *                                    holds its response, and what it writes, until
+ *                                    libwshttp__accept_many().
+ */
+extern LIBWSHTTP_API void libwshttp__set_mode(struct libwshttp *wh, int mode);
+
+/**
+ * answer the upgrade requests held by LIBWSHTTP_MODE_BATCH_ACCEPT in n sessions, with their
+ * accepts generated together, and queue the responses ahead of anything written since.
+ * the application flushes the sessions then. a session whose response cannot be queued is closed.
+ * return the number of sessions answered
+ */
+extern LIBWSHTTP_API int libwshttp__accept_many(struct libwshttp **wh, int n);
+
+/**
+ * offer, as a client, or accept, as a server, permessage-deflate with the parameters of d,
+ * before the handshake. a null d turns it off, it is never used with LIBWSHTTP_MODE_STREAM.
+ * once agreed, data messages of LIBWSHTTP_DEFLATE_MIN_SIZE bytes or more are sent compressed
+ * and compressed messages are delivered inflated.
+ */
+extern LIBWSHTTP_API void libwshttp__set_deflate(struct libwshttp *wh, const struct libws_deflate *d);
+
+/**
+ * create a pool of compression contexts for the sessions of one thread, it is not locked.
+ * sessions without context takeover borrow a zlib stream only while a message is compressed
+ * or inflated. sessions with context takeover keep theirs, limited to window_bits (9 to 15).
+ * once the zlib memory of all the sessions reaches budget bytes, new sessions only agree
+ * to no context takeover, and idle streams are freed instead of kept.
+ */
+extern LIBWSHTTP_API struct libwshttp_zpool *libwshttp__zpool_create(const struct libws_allocator *a, size_t budget,
+                                                                     int window_bits);
+
+/**
+ * free the pool, after every session which used it is destroyed
+ */
+extern LIBWSHTTP_API void libwshttp__zpool_destroy(struct libwshttp_zpool *zp);
+
+/**
+ * bytes of zlib memory held by the pool and its sessions
+ */
+extern LIBWSHTTP_API size_t libwshttp__zpool_used(struct libwshttp_zpool *zp);
+
+/**
+ * take the compression contexts of the session from zp, before the handshake
+ */
+extern LIBWSHTTP_API void libwshttp__set_zpool(struct libwshttp *wh, struct libwshttp_zpool *zp);
+
+/**
+ * limit the payload of a frame and of a reassembled message, 0 means no limit.
+ * the session is closed with WS_STATUS_MESSAGE_TOO_BIG as soon as a frame header
+ * exceeds a limit, before its payload is allocated. the limits of compressed frames
+ * and messages also apply to their inflated payload.
+ */
+extern LIBWSHTTP_API void libwshttp__set_limit(struct libwshttp *wh, uint64_t max_frame, uint64_t max_message);
+
 /**
  *
  */
 extern LIBWSHTTP_API int libwshttp__feed(struct libwshttp *wh, struct libws_b *b, struct libwshttp_event *evt);
 
+/**
+ * free the payload of an event returned by libwshttp__feed() when it is owned
+ */
+extern LIBWSHTTP_API void libwshttp__free(struct libwshttp *wh, struct libwshttp_event *evt);
+
 /**
  *
  *
  */
 extern LIBWSHTTP_API int libwshttp__write(struct libwshttp *wh, int opcode, struct libws_b *payload);
 
+/**
+ * write a data message with LIBWSHTTP_PRIORITY_HIGH, LIBWSHTTP_PRIORITY_NORMAL or LIBWSHTTP_PRIORITY_LOW,
+ * libwshttp__write() uses normal. control frames always go first. compressed
+ * messages keep their order under context takeover, so they all go normal.
+ */
+extern LIBWSHTTP_API int libwshttp__write_priority(struct libwshttp *wh, int opcode, struct libws_b *payload, int priority);
+
+/**
+ * build a server frame of payload once, for any number of sessions. with window_bits (9 to 15)
+ * a compressed frame is also built, for the sessions which agreed permessage-deflate without
+ * server context takeover and a window as large. 0 builds no compressed frame.
+ * the message starts with one reference.
+ */
+extern LIBWSHTTP_API struct libwshttp_prepared *libwshttp__prepare(const struct libws_allocator *a, int opcode,
+                                                                   const struct libws_b *payload, int window_bits);
+
+/**
+ * take and drop a reference, the message is freed with the last one
+ */
+extern LIBWSHTTP_API struct libwshttp_prepared *libwshttp__prepared_retain(struct libwshttp_prepared *pm);
+extern LIBWSHTTP_API void libwshttp__prepared_release(struct libwshttp_prepared *pm);
+
+/**
+ * send a prepared message on a server session, as its compressed or plain frame,
+ * or compressed by the session when it has context takeover.
+ */
+extern LIBWSHTTP_API int libwshttp__write_prepared(struct libwshttp *wh, struct libwshttp_prepared *pm);
+
 /**
  *
  */
@@ -94,96 +258,587 @@ extern LIBWSHTTP_API void libwshttp__close(struct libwshttp *wh, int close_statu
 #define LIBWS_IMPLEMENTATION
 #include "libws.h"
 
-#include "http_parser.h"
+#include <limits.h>
+#include <zlib.h>
+
+/** a zlib stream, idle in a pool or used by a session */
+struct libwshttp_zstream {
+    z_stream z;
+    struct libwshttp_zstream *next;
+};
+
+struct libwshttp_zpool {
+    const struct libws_allocator *a;
+    size_t budget;
+    size_t used;
+    int window_bits;
+    struct libwshttp_zstream *idle[2][16];  /* by direction and window bits */
+};
+
+/** built frames of one message, shared by reference, the frames follow in the same allocation */
+struct libwshttp_prepared {
+    int refs;
+    int opcode;
+    int window_bits;            /* of the compressed frame */
+    const struct libws_allocator *a;
+    struct libws_b frame;
+    struct libws_b deflated;    /* empty when compression did not pay */
+    struct libws_b payload;     /* inside frame */
+};
+
+/** control frames, then data by priority, then the close frame */
+#define LIBWSHTTP_LANE_CLOSE (LIBWSHTTP_PRIORITY_LOW + 1)
+#define LIBWSHTTP_LANES (LIBWSHTTP_LANE_CLOSE + 1)
+
+/** a buffer of whole frames in a lane, its data follows or is the frame of a prepared message */
+struct libwshttp_out {
+    struct libwshttp_out *next;
+    struct libwshttp_prepared *pm;
+    char *data;
+    uint64_t size;
+    uint64_t length;
+    uint64_t offset;    /* written so far */
+    int more;           /* the last frame is not the end of its message */
+};
+
+struct libwshttp_lane {
+    struct libwshttp_out *head;
+    struct libwshttp_out *tail;
+};
 
 struct libwshttp {
     int handshake;
-    http_parser http_p;
     struct libws_parser ws_p;
     char key[WS_KEY_LEN];
     char accept[WS_ACCEPT_LEN];
     char protocol[LIBWSHTTP_MAX_PROTOCOL_LEN];
-    const char *header_at;
-    size_t header_length;
+    char *http;         /* the part of the upgrade head read so far, when it takes more than a read */
+    size_t http_length;
+    char extensions[LIBWSHTTP_MAX_EXTENSIONS_LEN];
+    size_t extensions_length;
     int flags;
     int issrv;
     void *io;
     int (*write)(void *, const char *, int);
+    int (*writev)(void *, const struct libws_b *, int);
     void (*close)(void *);
+    void (*wait)(void *, int);
+    struct libwshttp_lane out[LIBWSHTTP_LANES];
+    uint64_t out_pending;
+    int out_busy;       /* 1 + the lane whose first buffer is partly written */
+    int out_message;    /* 1 + the lane of a fragmented message partly written */
+    int closed;         /* the close frame is sent or queued */
+    int accepting;      /* open, the response is held until libwshttp__accept_many() */
+    const struct libws_allocator *a;
+    int mode;
+    int failed;
+    uint64_t max_frame;
+    uint64_t max_message;
+    int msg_opcode;
+    char *msg;
+    uint64_t msg_length;
+    uint64_t msg_size;
+    int pmd;        /* permessage-deflate, 1 offered or accepted, 2 agreed */
+    struct libws_deflate pmd_want;
+    struct libws_deflate pmd_d;
+    struct libwshttp_zpool *zpool;
+    struct libwshttp_zstream *deflater;
+    struct libwshttp_zstream *inflater;
+    int inflating;  /* a compressed message is in progress */
+    int inflate_text;
+    uint32_t inflate_utf8;
 };
 
 
+static void
+__parser_mode(struct libwshttp *wh) {
+    int pmode = 0;
+
+    if (wh->mode & LIBWSHTTP_MODE_INPLACE) pmode |= WS_PARSER_INPLACE;
+    if (wh->mode & LIBWSHTTP_MODE_STREAM) pmode |= WS_PARSER_STREAM;
+    if (wh->mode & LIBWSHTTP_MODE_UTF8) pmode |= WS_PARSER_UTF8;
+    if (wh->pmd == 2) pmode |= WS_PARSER_RSV1;
+    libws__parser_mode(&wh->ws_p, pmode);
+}
+
+static void
+__out_free(struct libwshttp *wh, struct libwshttp_out *o) {
+    libwshttp__prepared_release(o->pm);
+    libws__free(wh->a, o);
+}
+
+static struct libwshttp_out *
+__out_new(struct libwshttp *wh, int lane, uint64_t size) {
+    struct libwshttp_lane *l = &wh->out[lane];
+    struct libwshttp_out *o;
+
+    o = (struct libwshttp_out *)libws__alloc(wh->a, sizeof *o + size);
+    if (!o) return 0;
+    memset(o, 0, sizeof *o);
+    o->data = (char *)(o + 1);
+    o->size = size;
+    if (l->tail)
+        l->tail->next = o;
+    else
+        l->head = o;
+    l->tail = o;
+    return o;
+}
+
+/**
+ * queue the rest of a frame whole in one buffer, so that lanes only switch between frames,
+ * in the room left by the last buffer unless it is being written
+ */
 static int
-__on_message_begin(http_parser *p) {
-    (void)p;
-    fprintf(stdout, "__on_message_begin\n");
+__out_frame(struct libwshttp *wh, int lane, const struct libws_b *b, int n, uint64_t done, int more) {
+    struct libwshttp_lane *l = &wh->out[lane];
+    struct libwshttp_out *o = l->tail;
+    uint64_t left = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        left += b[i].length;
+    left -= done;
+    if (!o || o->pm || o->size - o->length < left || (o == l->head && wh->out_busy == lane + 1)) {
+        o = __out_new(wh, lane, left > LIBWSHTTP_OUT_CHUNK ? left : LIBWSHTTP_OUT_CHUNK);
+        if (!o) return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (done >= b[i].length) {
+            done -= b[i].length;
+            continue;
+        }
+        memcpy(o->data + o->length, b[i].data + done, b[i].length - done);
+        o->length += b[i].length - done;
+        done = 0;
+    }
+    o->more = more;
+    wh->out_pending += left;
     return 0;
 }
 
+/** a transport without writev gets the buffers joined */
 static int
-__on_url(http_parser *p, const char *at, size_t length) {
-    (void)p;
-    fprintf(stdout, "__on_url %.*s\n", (int)length, at);
-    return 0;
+__write_joined(struct libwshttp *wh, const struct libws_b *b, int n, uint64_t total) {
+    char *data;
+    uint64_t used = 0;
+    int i, rc;
+
+    data = (char *)libws__alloc(wh->a, (size_t)total);
+    if (!data) return -1;
+    for (i = 0; i < n; i++) {
+        memcpy(data + used, b[i].data, b[i].length);
+        used += b[i].length;
+    }
+    rc = wh->write(wh->io, data, (int)total);
+    libws__free(wh->a, data);
+    return rc;
 }
 
+/**
+ * send the n buffers of a frame in the lane, what io does not take now is queued.
+ * more tells that the message goes on in the next frame. the frame of a prepared
+ * message pm, as the only buffer, is queued by reference
+ */
 static int
-__on_status(http_parser *p, const char *at, size_t length) {
-    (void)p;
-    fprintf(stdout, "__on_status %.*s\n", (int)length, at);
+__send(struct libwshttp *wh, const struct libws_b *b, int n, int lane, int more, struct libwshttp_prepared *pm) {
+    uint64_t total = 0, done = 0;
+    int i, rc, empty;
+
+    for (i = 0; i < n; i++)
+        total += b[i].length;
+    /* io counts in int, a frame it cannot count is refused */
+    if (total > INT_MAX) return -1;
+    if (!wh->wait) {
+        if (wh->writev)
+            return wh->writev(wh->io, b, n) == (int)total ? 0 : -1;
+        if (n == 1)
+            return wh->write(wh->io, b->data, (int)b->length);
+        return __write_joined(wh, b, n, total);
+    }
+    empty = !wh->out_pending;
+    /* behind a queue, nothing may overtake it. a large frame is not worth the copy */
+    if (empty && !wh->accepting && (!lane || !wh->out_message || wh->out_message == lane + 1) &&
+        (!(wh->mode & LIBWSHTTP_MODE_COALESCE) || total >= LIBWSHTTP_OUT_CHUNK)) {
+        rc = wh->writev(wh->io, b, n);
+        if (rc < 0) return -1;
+        done = rc;
+        if (done == total) {
+            if (lane) wh->out_message = more ? lane + 1 : 0;
+            return 0;
+        }
+        if (done) wh->out_busy = lane + 1;
+    }
+    if (pm) {
+        struct libwshttp_out *o = __out_new(wh, lane, 0);
+        if (!o) return -1;
+        o->pm = libwshttp__prepared_retain(pm);
+        o->data = b->data;
+        o->size = o->length = b->length;
+        o->offset = done;
+        wh->out_pending += b->length - done;
+    } else if (__out_frame(wh, lane, b, n, done, more)) {
+        return -1;
+    }
+    if (empty)
+        wh->wait(wh->io, 1);
     return 0;
 }
 
+/**
+ * send a message in the lane, as frames of LIBWSHTTP_OUT_FRAGMENT bytes when it may be queued.
+ * flags are of the first frame, a payload owned by the caller is masked in place
+ */
+static int
+__send_message(struct libwshttp *wh, int flags, const struct libws_b *payload, int lane, int owned) {
+    char head[WS_FRAME_HEADER_MAX];
+    char small[WS_FRAME_HEADER_MAX + WS_CONTROL_MAX];
+    struct libws_b b[2];
+    char *data = payload->data, *frame;
+    uint64_t length = payload->data ? payload->length : 0, piece;
+    int n, rc;
+
+    for (;;) {
+        piece = length;
+        if (wh->wait && lane && piece > LIBWSHTTP_OUT_FRAGMENT)
+            piece = LIBWSHTTP_OUT_FRAGMENT;
+        if (piece == length)
+            WS_BUILD_FIN(flags);
+        n = libws__build_header(head, flags, piece);
+        b[0].data = head;
+        b[0].length = n;
+        b[1].data = data;
+        b[1].length = piece;
+        frame = 0;
+        if (piece <= WS_CONTROL_MAX || ((flags & WS_FLAG_MASK) && !owned)) {
+            /* short frames and masked copies are built whole, short ones on the stack */
+            frame = piece <= WS_CONTROL_MAX ? small : (char *)libws__alloc(wh->a, (size_t)(n + piece));
+            if (!frame) return -1;
+            memcpy(frame, head, n);
+            if (flags & WS_FLAG_MASK)
+                libws__mask(frame + n, head + n - 4, data, piece, 0);
+            else if (piece)
+                memcpy(frame + n, data, piece);
+            b[0].data = frame;
+            b[0].length = n + piece;
+            b[1].length = 0;
+        } else if (flags & WS_FLAG_MASK) {
+            libws__mask(data, head + n - 4, data, piece, 0);
+        }
+        rc = __send(wh, b, b[1].length ? 2 : 1, lane, piece < length, 0);
+        if (frame != small)
+            libws__free(wh->a, frame);
+        if (rc || piece == length)
+            return rc;
+        data += piece;
+        length -= piece;
+        /* the next frames are continuations, RSV1 is only on the first */
+        flags &= WS_FLAG_MASK;
+    }
+}
+
+static voidpf
+__zalloc(voidpf opaque, uInt items, uInt size) {
+    struct libwshttp *wh = (struct libwshttp *)opaque;
+    return libws__alloc(wh->a, (size_t)items * size);
+}
+
+static void
+__zfree(voidpf opaque, voidpf ptr) {
+    struct libwshttp *wh = (struct libwshttp *)opaque;
+    libws__free(wh->a, ptr);
+}
+
+/** the window bits of what this end sends, or of what it receives */
 static int
-__on_header_field(http_parser *p, const char *at, size_t length) {
-    struct libwshttp *wh = (struct libwshttp *)p->data;
-    wh->header_at = at;
-    wh->header_length = length;
-    fprintf(stdout, "__on_header_field %.*s\n", (int)length, at);
+__window_bits(struct libwshttp *wh, int sending) {
+    int bits = wh->issrv == sending ? wh->pmd_d.server_max_window_bits : wh->pmd_d.client_max_window_bits;
+    return bits ? bits : 15;
+}
+
+static int
+__no_context_takeover(struct libwshttp *wh, int sending) {
+    return wh->issrv == sending ? wh->pmd_d.server_no_context_takeover : wh->pmd_d.client_no_context_takeover;
+}
+
+/* every allocation of a pool carries its size, 16 bytes keep the alignment */
+static voidpf
+__zpool_alloc(voidpf opaque, uInt items, uInt size) {
+    struct libwshttp_zpool *zp = (struct libwshttp_zpool *)opaque;
+    size_t n = (size_t)items * size;
+    char *p = (char *)libws__alloc(zp->a, n + 16);
+
+    if (!p) return 0;
+    memcpy(p, &n, sizeof n);
+    zp->used += n;
+    return p + 16;
+}
+
+static void
+__zpool_free(voidpf opaque, voidpf ptr) {
+    struct libwshttp_zpool *zp = (struct libwshttp_zpool *)opaque;
+    char *p = (char *)ptr - 16;
+    size_t n;
+
+    memcpy(&n, p, sizeof n);
+    zp->used -= n;
+    libws__free(zp->a, p);
+}
+
+/* a small window needs no larger hash table */
+static int
+__mem_level(int bits) {
+    return bits >= 15 ? LIBWSHTTP_DEFLATE_MEMLEVEL : (bits > 8 ? bits - 7 : 1);
+}
+
+static struct libwshttp_zstream *
+__zstream_new(alloc_func zalloc, free_func zfree, voidpf opaque, int sending, int bits) {
+    struct libwshttp_zstream *zs;
+    int rc;
+
+    zs = (struct libwshttp_zstream *)zalloc(opaque, 1, sizeof *zs);
+    if (!zs) return 0;
+    memset(zs, 0, sizeof *zs);
+    zs->z.zalloc = zalloc;
+    zs->z.zfree = zfree;
+    zs->z.opaque = opaque;
+    if (sending)
+        rc = deflateInit2(&zs->z, LIBWSHTTP_DEFLATE_LEVEL, Z_DEFLATED, -bits, __mem_level(bits), Z_DEFAULT_STRATEGY);
+    else
+        rc = inflateInit2(&zs->z, -bits);
+    if (rc != Z_OK) {
+        zfree(opaque, zs);
+        return 0;
+    }
+    return zs;
+}
+
+static void
+__zstream_free(struct libwshttp_zstream *zs, int sending) {
+    if (sending)
+        deflateEnd(&zs->z);
+    else
+        inflateEnd(&zs->z);
+    zs->z.zfree(zs->z.opaque, zs);
+}
+
+/**
+ * the zlib stream of one direction, created on first use, or borrowed
+ * from the pool for one message without context takeover
+ */
+static z_stream *
+__zstream(struct libwshttp *wh, int sending) {
+    struct libwshttp_zstream **pz = sending ? &wh->deflater : &wh->inflater;
+    struct libwshttp_zpool *zp = wh->zpool;
+    int bits = __window_bits(wh, sending);
+
+    if (*pz) return &(*pz)->z;
+    if (zp && __no_context_takeover(wh, sending) && zp->idle[sending][bits]) {
+        *pz = zp->idle[sending][bits];
+        zp->idle[sending][bits] = (*pz)->next;
+    } else if (zp) {
+        *pz = __zstream_new(__zpool_alloc, __zpool_free, zp, sending, bits);
+    } else {
+        *pz = __zstream_new(__zalloc, __zfree, wh, sending, bits);
+    }
+    return *pz ? &(*pz)->z : 0;
+}
+
+/**
+ * a message is done, the window is dropped without context takeover
+ * and a stream of a pool goes back to it
+ */
+static void
+__zstream_done(struct libwshttp *wh, int sending) {
+    struct libwshttp_zstream **pz = sending ? &wh->deflater : &wh->inflater;
+    struct libwshttp_zpool *zp = wh->zpool;
+    int bits = __window_bits(wh, sending);
+
+    if (!*pz || !__no_context_takeover(wh, sending))
+        return;
+    if (sending)
+        deflateReset(&(*pz)->z);
+    else
+        inflateReset(&(*pz)->z);
+    if (!zp)
+        return;
+    if (zp->used > zp->budget) {
+        __zstream_free(*pz, sending);
+    } else {
+        (*pz)->next = zp->idle[sending][bits];
+        zp->idle[sending][bits] = *pz;
+    }
+    *pz = 0;
+}
+
+/** the parameters to negotiate, within the window and the budget of the pool */
+static void
+__deflate_want(struct libwshttp *wh, struct libws_deflate *d) {
+    struct libwshttp_zpool *zp = wh->zpool;
+
+    *d = wh->pmd_want;
+    if (!zp) return;
+    if (zp->used >= zp->budget) {
+        d->server_no_context_takeover = 1;
+        d->client_no_context_takeover = 1;
+        return;
+    }
+    if (!d->server_no_context_takeover && (!d->server_max_window_bits || d->server_max_window_bits > zp->window_bits))
+        d->server_max_window_bits = zp->window_bits;
+    if (!d->client_no_context_takeover && (!d->client_max_window_bits || d->client_max_window_bits > zp->window_bits))
+        d->client_max_window_bits = zp->window_bits;
+}
+
+/** the first c in [s, e), 16 bytes at a time */
+static const char *
+__http_find(const char *s, const char *e, char c) {
+#if defined(LIBWS_X86) && defined(__SSE2__)
+    __m128i v = _mm_set1_epi8(c);
+    int m;
+
+    for (; e - s >= 16; s += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s), v));
+        if (m) return s + __builtin_ctz(m);
+    }
+#endif
+    for (; s < e; s++)
+        if (*s == c) return s;
+    return 0;
+}
+
+/** the end of the head in p, the CRLF of its empty line, searched from from */
+static const char *
+__http_end(const char *p, size_t n, size_t from) {
+    const char *s = p + from, *e = p + n, *lf;
+
+    while ((lf = __http_find(s, e, '\n'))) {
+        if (lf - p >= 3 && lf[-1] == '\r' && lf[-2] == '\n' && lf[-3] == '\r')
+            return lf + 1;
+        s = lf + 1;
+    }
     return 0;
 }
 
+/** a request line of GET, or a status line of 101, in HTTP/1.1 */
+static int
+__http_start(struct libwshttp *wh, const char *p, const char *e) {
+    size_t n = e - p;
+
+    if (wh->issrv)
+        return n > 13 && !memcmp(p, "GET ", 4) && !memcmp(e - 9, " HTTP/1.1", 9) ? 0 : -1;
+    return n >= 12 && !memcmp(p, "HTTP/1.1 101", 12) && (n == 12 || p[12] == ' ') ? 0 : -1;
+}
+
 static int
-__on_header_value(http_parser *p, const char *at, size_t length) {
-    struct libwshttp *wh = (struct libwshttp *)p->data;
-    int flag = libws__valid_header(&wh->flags, wh->header_at, wh->header_length, at, length);
+__on_header(struct libwshttp *wh, const char *name, size_t name_length, const char *value, size_t length) {
+    int flag = libws__valid_header(&wh->flags, name, name_length, value, length);
     if (flag == WS_HEADER_KEY) {
-        strncpy(wh->key, at, length);
+        memcpy(wh->key, value, WS_KEY_LEN);
     } else if (flag == WS_HEADER_ACCEPT) {
-        strncpy(wh->accept, at, length);
+        memcpy(wh->accept, value, WS_ACCEPT_LEN);
     } else if (flag == WS_HEADER_PROTOCOL) {
-        int n = length < LIBWSHTTP_MAX_PROTOCOL_LEN ? length : LIBWSHTTP_MAX_PROTOCOL_LEN;
-        strncpy(wh->protocol, at, n);
+        /* the first of the list, when it fits */
+        size_t n = 0;
+        while (n < length && value[n] != ',' && value[n] != ' ' && value[n] != '\t')
+            n++;
+        if (n < LIBWSHTTP_MAX_PROTOCOL_LEN && !wh->protocol[0]) {
+            memcpy(wh->protocol, value, n);
+            wh->protocol[n] = '\0';
+        }
+    } else if (flag == WS_HEADER_EXTENSIONS) {
+        /* gather every extensions header as one list, negotiated with the whole headers */
+        size_t n = wh->extensions_length;
+        if (n && n + 2 <= sizeof wh->extensions) {
+            memcpy(wh->extensions + n, ", ", 2);
+            n += 2;
+        }
+        if (n + length > sizeof wh->extensions)
+            return -1;
+        memcpy(wh->extensions + n, value, length);
+        wh->extensions_length = n + length;
     }
-    fprintf(stdout, "__on_header_value %.*s\n", (int)length, at);
     return 0;
 }
 
+/**
+ * the lines of a whole head in [p, e), which ends with its empty line.
+ * folded lines and bare LFs are refused, values are trimmed
+ */
+static int
+__http_head(struct libwshttp *wh, const char *p, const char *e) {
+    const char *lf, *colon, *v, *ve;
+
+    lf = __http_find(p, e, '\n');
+    if (lf == p || lf[-1] != '\r' || __http_start(wh, p, lf - 1))
+        return -1;
+    for (p = lf + 1;; p = lf + 1) {
+        lf = __http_find(p, e, '\n');
+        if (lf[-1] != '\r') return -1;
+        if (lf - 1 == p) return 0;
+        colon = __http_find(p, lf - 1, ':');
+        if (!colon || colon == p || *p == ' ' || *p == '\t' || colon[-1] == ' ' || colon[-1] == '\t')
+            return -1;
+        v = colon + 1;
+        ve = lf - 1;
+        while (v < ve && (*v == ' ' || *v == '\t'))
+            v++;
+        while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t'))
+            ve--;
+        if (__on_header(wh, p, colon - p, v, ve - v))
+            return -1;
+    }
+}
+
 static int
-__on_headers_complete(http_parser *p) {
-    struct libwshttp *wh = (struct libwshttp *)p->data;
-    fprintf(stdout, "__on_headers_complete\n");
+__on_headers_complete(struct libwshttp *wh) {
     if (wh->flags != (wh->issrv ? WS_HEADER_REQ : WS_HEADER_RSP)) {
         return -1;
     }
+    if (wh->extensions_length && wh->issrv) {
+        struct libws_deflate want;
+
+        __deflate_want(wh, &want);
+        if (wh->pmd == 1 && !(wh->mode & LIBWSHTTP_MODE_STREAM)
+            && !libws__deflate_negotiate(&wh->pmd_d, &want, 1, wh->extensions, wh->extensions_length))
+            wh->pmd = 2;
+    } else if (wh->extensions_length) {
+        struct libws_deflate want;
+
+        /* a server must not answer with an extension which was not offered */
+        __deflate_want(wh, &want);
+        if (wh->pmd != 1 || libws__deflate_negotiate(&wh->pmd_d, &want, 0, wh->extensions, wh->extensions_length))
+            return -1;
+        wh->pmd = 2;
+    }
     return 0;
 }
 
+/** the response to the upgrade request, with wh->accept */
 static int
-__on_body(http_parser *p, const char *at, size_t length) {
-    (void)p;
-    fprintf(stdout, "__on_body %.*s\n", (int)length, at);
-    return 0;
+__response(struct libwshttp *wh, char response[LIBWSHTTP_MAX_HTTP_LEN]) {
+    char extensions[LIBWSHTTP_MAX_EXTENSIONS_LEN];
+
+    if (wh->pmd == 2)
+        libws__deflate_format(extensions, sizeof extensions, &wh->pmd_d, 0);
+    return libws__response_accept(response, LIBWSHTTP_MAX_HTTP_LEN, LIBWSHTTP_DEF_SERVER, wh->protocol,
+                                  wh->pmd == 2 ? extensions : 0, wh->accept);
 }
 
 static int
-__on_message_complete(http_parser *p) {
-    struct libwshttp *wh = (struct libwshttp *)p->data;
-    fprintf(stdout, "__on_message_complete\n");
-    if (wh->issrv) {
+__on_message_complete(struct libwshttp *wh) {
+    if (wh->issrv && wh->wait && (wh->mode & LIBWSHTTP_MODE_BATCH_ACCEPT)) {
+        wh->accepting = 1;
+        wh->handshake = 1;
+    } else if (wh->issrv) {
         char response[LIBWSHTTP_MAX_HTTP_LEN];
-        int n = libws__response(response, LIBWSHTTP_MAX_HTTP_LEN, LIBWSHTTP_DEF_SERVER, wh->protocol, wh->key, wh->accept);
-        if (wh->write(wh->io, response, n)) {
+        int n;
+
+        libws__generate_accept(wh->accept, wh->key);
+        n = __response(wh, response);
+        struct libws_b b = {response, (uint64_t)n};
+
+        /* ahead of any frame */
+        if (__send(wh, &b, 1, 0, 0, 0)) {
             return -1;
         } else {
             wh->handshake = 1;
@@ -195,58 +850,533 @@ __on_message_complete(http_parser *p) {
             return -1;
         }
     }
+    __parser_mode(wh);
     return 0;
 }
 
+/**
+ * take the upgrade head from b, return 1 when it is done, 0 for more or -1 on error.
+ * a head whole in b is parsed there, else it is gathered in wh->http
+ */
+static int
+__http_feed(struct libwshttp *wh, struct libws_b *b) {
+    const char *end;
+    size_t old = wh->http_length, take;
+    int rc;
+
+    if (!old && (end = __http_end(b->data, b->length, 0))) {
+        rc = __http_head(wh, b->data, end);
+        b->length -= end - b->data;
+        b->data = (char *)end;
+    } else {
+        if (!wh->http && !(wh->http = (char *)libws__alloc(wh->a, LIBWSHTTP_MAX_HTTP_LEN)))
+            return -1;
+        take = b->length < LIBWSHTTP_MAX_HTTP_LEN - old ? b->length : LIBWSHTTP_MAX_HTTP_LEN - old;
+        memcpy(wh->http + old, b->data, take);
+        wh->http_length += take;
+        end = __http_end(wh->http, wh->http_length, old >= 3 ? old - 3 : 0);
+        if (!end) {
+            b->length -= take;
+            b->data += take;
+            return wh->http_length < LIBWSHTTP_MAX_HTTP_LEN ? 0 : -1;
+        }
+        take = end - wh->http - old;
+        b->length -= take;
+        b->data += take;
+        rc = __http_head(wh, wh->http, end);
+        libws__free(wh->a, wh->http);
+        wh->http = 0;
+        wh->http_length = 0;
+    }
+    if (rc || __on_headers_complete(wh) || __on_message_complete(wh))
+        return -1;
+    return 1;
+}
+
 struct libwshttp *
 libwshttp__create(int issrv, void *io, int (*write)(void *io, const char *data, int size), void (*close)(void *io)) {
+    return libwshttp__create_ex(issrv, io, write, close, 0);
+}
+
+struct libwshttp *
+libwshttp__create_ex(int issrv, void *io, int (*write)(void *io, const char *data, int size), void (*close)(void *io),
+                     const struct libws_allocator *a) {
     struct libwshttp *wh;
 
-    wh = (struct libwshttp *)malloc(sizeof *wh);
+    wh = (struct libwshttp *)libws__alloc(a, sizeof *wh);
+    if (!wh) return 0;
     memset(wh, 0, sizeof *wh);
 
+    wh->a = a;
     wh->issrv = issrv;
     wh->io = io;
     wh->write = write;
     wh->close = close;
-    http_parser_init(&wh->http_p, issrv ? HTTP_REQUEST : HTTP_RESPONSE);
-    wh->http_p.data = wh;
     libws__parser_init(&wh->ws_p);
+    libws__parser_allocator(&wh->ws_p, a);
 
     return wh;
 }
 
+void
+libwshttp__set_writev(struct libwshttp *wh, int (*writev)(void *io, const struct libws_b *b, int n)) {
+    wh->writev = writev;
+}
+
+void
+libwshttp__set_queue(struct libwshttp *wh, void (*wait)(void *io, int on)) {
+    wh->wait = wait;
+}
+
+/** the lane of the next buffer to write, when each buffer before is written whole */
+static int
+__out_lane(struct libwshttp_out **head, int busy, int message) {
+    int i;
+
+    if (busy) return busy - 1;
+    if (head[0]) return 0;
+    /* no data of another message between the frames of a fragmented one */
+    if (message && head[message - 1]) return message - 1;
+    for (i = 1; i < LIBWSHTTP_LANES; i++)
+        if (head[i]) return i;
+    return -1;
+}
+
+int
+libwshttp__flush(struct libwshttp *wh) {
+    struct libws_b b[LIBWSHTTP_OUT_IOV];
+    struct libwshttp_out *head[LIBWSHTTP_LANES], *o;
+    struct libwshttp_lane *q;
+    int lane[LIBWSHTTP_OUT_IOV];
+    uint64_t total, done;
+    int i, n, l, busy, message, rc;
+
+    if (wh->accepting) return 1;
+    if (!wh->out_pending) return 0;
+    while (wh->out_pending) {
+        for (i = 0; i < LIBWSHTTP_LANES; i++)
+            head[i] = wh->out[i].head;
+        busy = wh->out_busy;
+        message = wh->out_message;
+        total = 0;
+        for (n = 0; n < LIBWSHTTP_OUT_IOV && (l = __out_lane(head, busy, message)) >= 0; n++) {
+            o = head[l];
+            if (n && total + (o->length - o->offset) > INT_MAX) break;
+            head[l] = o->next;
+            lane[n] = l;
+            b[n].data = o->data + o->offset;
+            b[n].length = o->length - o->offset;
+            total += b[n].length;
+            busy = 0;
+            if (l) message = o->more ? l + 1 : 0;
+        }
+        rc = wh->writev(wh->io, b, n);
+        if (rc < 0) return -1;
+        done = rc;
+        wh->out_pending -= done;
+        for (i = 0; i < n; i++) {
+            q = &wh->out[lane[i]];
+            o = q->head;
+            if (done < o->length - o->offset) {
+                if (done) {
+                    o->offset += done;
+                    wh->out_busy = lane[i] + 1;
+                }
+                break;
+            }
+            done -= o->length - o->offset;
+            if (!(q->head = o->next))
+                q->tail = 0;
+            wh->out_busy = 0;
+            if (lane[i])
+                wh->out_message = o->more ? lane[i] + 1 : 0;
+            __out_free(wh, o);
+        }
+        if ((uint64_t)rc < total)
+            return 1;
+    }
+    wh->wait(wh->io, 0);
+    if (wh->closed)
+        wh->close(wh->io);
+    return 0;
+}
+
+/** queue the held response ahead of the frames queued while it was held, nothing is written yet */
+static int
+__accept_send(struct libwshttp *wh, const char accept[WS_ACCEPT_LEN]) {
+    struct libwshttp_lane *l = &wh->out[0];
+    struct libwshttp_out *o;
+    char response[LIBWSHTTP_MAX_HTTP_LEN];
+    int n, empty = !wh->out_pending;
+
+    memcpy(wh->accept, accept, WS_ACCEPT_LEN);
+    n = __response(wh, response);
+    o = (struct libwshttp_out *)libws__alloc(wh->a, sizeof *o + n);
+    if (!o) return -1;
+    memset(o, 0, sizeof *o);
+    o->data = (char *)(o + 1);
+    o->size = o->length = n;
+    memcpy(o->data, response, n);
+    if (!(o->next = l->head))
+        l->tail = o;
+    l->head = o;
+    wh->out_pending += o->length;
+    wh->accepting = 0;
+    if (empty)
+        wh->wait(wh->io, 1);
+    return 0;
+}
+
+int
+libwshttp__accept_many(struct libwshttp **wh, int n) {
+    char accept[LIBWSHTTP_ACCEPT_BATCH][WS_ACCEPT_LEN];
+    char *accepts[LIBWSHTTP_ACCEPT_BATCH];
+    const char *keys[LIBWSHTTP_ACCEPT_BATCH];
+    struct libwshttp *batch[LIBWSHTTP_ACCEPT_BATCH];
+    int i, j, m, answered = 0;
+
+    for (i = 0; i < n;) {
+        for (m = 0; i < n && m < LIBWSHTTP_ACCEPT_BATCH; i++) {
+            if (!wh[i]->accepting) continue;
+            batch[m] = wh[i];
+            keys[m] = batch[m]->key;
+            accepts[m] = accept[m];
+            m++;
+        }
+        libws__generate_accept_many(accepts, keys, m);
+        for (j = 0; j < m; j++) {
+            if (__accept_send(batch[j], accept[j])) {
+                batch[j]->accepting = 0;
+                batch[j]->failed = 1;
+                batch[j]->close(batch[j]->io);
+                continue;
+            }
+            answered++;
+        }
+    }
+    return answered;
+}
+
+uint64_t
+libwshttp__pending(struct libwshttp *wh) {
+    return wh->out_pending;
+}
+
+void
+libwshttp__set_mode(struct libwshttp *wh, int mode) {
+    /* chunks are never reassembled */
+    if (mode & LIBWSHTTP_MODE_STREAM)
+        mode &= ~LIBWSHTTP_MODE_MESSAGE;
+    wh->mode = mode;
+    __parser_mode(wh);
+}
+
+void
+libwshttp__set_deflate(struct libwshttp *wh, const struct libws_deflate *d) {
+    wh->pmd = d ? 1 : 0;
+    if (d) wh->pmd_want = *d;
+}
+
+void
+libwshttp__set_zpool(struct libwshttp *wh, struct libwshttp_zpool *zp) {
+    wh->zpool = zp;
+}
+
+struct libwshttp_zpool *
+libwshttp__zpool_create(const struct libws_allocator *a, size_t budget, int window_bits) {
+    struct libwshttp_zpool *zp;
+
+    zp = (struct libwshttp_zpool *)libws__alloc(a, sizeof *zp);
+    if (!zp) return 0;
+    memset(zp, 0, sizeof *zp);
+    zp->a = a;
+    zp->budget = budget;
+    zp->window_bits = window_bits < 9 ? 9 : (window_bits > 15 ? 15 : window_bits);
+    return zp;
+}
+
+void
+libwshttp__zpool_destroy(struct libwshttp_zpool *zp) {
+    struct libwshttp_zstream *zs;
+    int sending, bits;
+
+    for (sending = 0; sending < 2; sending++) {
+        for (bits = 0; bits < 16; bits++) {
+            while ((zs = zp->idle[sending][bits])) {
+                zp->idle[sending][bits] = zs->next;
+                __zstream_free(zs, sending);
+            }
+        }
+    }
+    libws__free(zp->a, zp);
+}
+
+size_t
+libwshttp__zpool_used(struct libwshttp_zpool *zp) {
+    return zp->used;
+}
+
+void
+libwshttp__set_limit(struct libwshttp *wh, uint64_t max_frame, uint64_t max_message) {
+    wh->max_frame = max_frame;
+    wh->max_message = max_message;
+    libws__parser_limit(&wh->ws_p, max_frame);
+}
+
 int
 libwshttp__request(struct libwshttp *wh, const char *url, const char *host, const char *protocol) {
     char request[LIBWSHTTP_MAX_HTTP_LEN];
-    int n = libws__request(request, LIBWSHTTP_MAX_HTTP_LEN, url, host, host, protocol, wh->key);
-    return wh->write(wh->io, request, n);
+    char extensions[LIBWSHTTP_MAX_EXTENSIONS_LEN];
+    struct libws_deflate want;
+    struct libws_b b;
+    int n;
+
+    if (wh->mode & LIBWSHTTP_MODE_STREAM)
+        wh->pmd = 0;
+    __deflate_want(wh, &want);
+    if (wh->pmd)
+        libws__deflate_format(extensions, sizeof extensions, &want, 1);
+    n = libws__request(request, LIBWSHTTP_MAX_HTTP_LEN, url, host, host, protocol,
+                       wh->pmd ? extensions : 0, wh->key);
+    b.data = request;
+    b.length = n;
+    return __send(wh, &b, 1, 0, 0, 0);
+}
+
+static void
+__fail(struct libwshttp *wh, int status) {
+    const char *reason;
+
+    switch (status) {
+    case WS_STATUS_MESSAGE_TOO_BIG:
+        reason = "message too big";
+        break;
+    case WS_STATUS_UNEXPECTED_CONDITION:
+        reason = "unexpected condition";
+        break;
+    case WS_STATUS_INVALID_PAYLOAD:
+        reason = "invalid payload";
+        break;
+    default:
+        status = WS_STATUS_PROTOCOL_ERROR;
+        reason = "protocol error";
+        break;
+    }
+    wh->failed = 1;
+    libwshttp__close(wh, status, reason);
+}
+
+static uint64_t
+__message_budget(struct libwshttp *wh) {
+    uint64_t budget = wh->max_frame;
+
+    if (wh->max_message) {
+        /* a full message still lets an empty frame through, __message rejects the rest */
+        uint64_t left = wh->max_message > wh->msg_length ? wh->max_message - wh->msg_length : 1;
+        if (!budget || left < budget) budget = left;
+    }
+    return budget;
+}
+
+/**
+ * reassemble a fragmented message from data frame f.
+ * return 1 when f is a whole message, 0 when f was consumed, -1 on error
+ */
+static int
+__message(struct libwshttp *wh, struct libws_frame *f) {
+    if (f->opcode == WS_OPCODE_CONTINUATION) {
+        if (!wh->msg_opcode) {
+            libws__frame_free(&wh->ws_p, f);
+            __fail(wh, WS_STATUS_PROTOCOL_ERROR);
+            return -1;
+        }
+    } else if (wh->msg_opcode) {
+        libws__frame_free(&wh->ws_p, f);
+        __fail(wh, WS_STATUS_PROTOCOL_ERROR);
+        return -1;
+    } else if (f->fin) {
+        return 1;
+    } else {
+        wh->msg_opcode = f->opcode;
+        if (f->owned) {
+            /* adopt the first fragment as the message buffer */
+            wh->msg = f->payload.data;
+            wh->msg_length = f->payload.length;
+            wh->msg_size = f->payload.length;
+            f->owned = 0;
+            return 0;
+        }
+    }
+
+    if (wh->max_message && wh->msg_length + f->payload.length > wh->max_message) {
+        libws__frame_free(&wh->ws_p, f);
+        __fail(wh, WS_STATUS_MESSAGE_TOO_BIG);
+        return -1;
+    }
+    if (wh->msg_length + f->payload.length > wh->msg_size) {
+        uint64_t size = wh->msg_size ? wh->msg_size : 256;
+        char *msg;
+
+        while (size < wh->msg_length + f->payload.length)
+            size *= 2;
+        if (wh->max_message && size > wh->max_message)
+            size = wh->max_message;
+        msg = libws__realloc(wh->a, wh->msg, (size_t)size);
+        if (!msg) {
+            libws__frame_free(&wh->ws_p, f);
+            __fail(wh, WS_STATUS_UNEXPECTED_CONDITION);
+            return -1;
+        }
+        wh->msg = msg;
+        wh->msg_size = size;
+    }
+    if (f->payload.length)
+        memcpy(wh->msg + wh->msg_length, f->payload.data, f->payload.length);
+    wh->msg_length += f->payload.length;
+    libws__frame_free(&wh->ws_p, f);
+    if (!f->fin)
+        return 0;
+
+    f->opcode = wh->msg_opcode;
+    f->owned = wh->msg != 0;
+    f->payload.data = wh->msg;
+    f->payload.length = wh->msg_length;
+    wh->msg = 0;
+    wh->msg_length = 0;
+    wh->msg_size = 0;
+    wh->msg_opcode = 0;
+    return 1;
+}
+
+/**
+ * inflate the payload of a frame of a compressed message in place of it,
+ * the last frame gets back the 4 bytes tail the sender removed.
+ * return 0, or -1 when the session failed
+ */
+static int
+__inflate(struct libwshttp *wh, struct libws_frame *f) {
+    static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+    z_stream *z = __zstream(wh, 0);
+    uint64_t limit = (uint64_t)-1, size = 0, used = 0;
+    char *out = 0;
+    int rc, status = 0, tailed = !f->fin, pending = 0;
+
+    /* the limits are on what is delivered, a small frame may inflate to anything */
+    if ((wh->mode & LIBWSHTTP_MODE_MESSAGE) && wh->max_message)
+        limit = wh->max_message - wh->msg_length;
+    else if (!(wh->mode & LIBWSHTTP_MODE_MESSAGE) && wh->max_frame)
+        limit = wh->max_frame;
+    if (!z) {
+        status = WS_STATUS_UNEXPECTED_CONDITION;
+        goto failed;
+    }
+    if (f->payload.length > UINT_MAX) {
+        status = WS_STATUS_MESSAGE_TOO_BIG;
+        goto failed;
+    }
+    z->next_in = (Bytef *)f->payload.data;
+    z->avail_in = (uInt)f->payload.length;
+    for (;;) {
+        if (!z->avail_in && !pending) {
+            if (tailed) break;
+            z->next_in = (Bytef *)tail;
+            z->avail_in = sizeof tail;
+            tailed = 1;
+        }
+        if (used == size) {
+            char *p;
+
+            size = size ? size * 2 : (f->payload.length < 64 ? 256 : f->payload.length * 4);
+            if (size > limit) size = limit + 1;
+            if (size > UINT_MAX) size = UINT_MAX;
+            if (size == used || !(p = (char *)libws__realloc(wh->a, out, (size_t)size))) {
+                status = WS_STATUS_UNEXPECTED_CONDITION;
+                goto failed;
+            }
+            out = p;
+        }
+        z->next_out = (Bytef *)out + used;
+        z->avail_out = (uInt)(size - used);
+        rc = inflate(z, Z_SYNC_FLUSH);
+        used = (char *)z->next_out - out;
+        if (rc == Z_STREAM_END) {
+            /* a final block ends the stream, what follows starts a new one */
+            inflateReset(z);
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            status = rc == Z_MEM_ERROR ? WS_STATUS_UNEXPECTED_CONDITION : WS_STATUS_INVALID_PAYLOAD;
+            goto failed;
+        }
+        if (used > limit) {
+            status = WS_STATUS_MESSAGE_TOO_BIG;
+            goto failed;
+        }
+        pending = z->avail_out == 0;
+    }
+    if (f->fin)
+        __zstream_done(wh, 0);
+
+    if ((wh->mode & LIBWSHTTP_MODE_UTF8) && wh->inflate_text) {
+        if (used)
+            libws__mask_utf8(out, "\0\0\0\0", out, used, 0, &wh->inflate_utf8);
+        if (wh->inflate_utf8 == WS_UTF8_REJECT || (f->fin && wh->inflate_utf8 != WS_UTF8_ACCEPT)) {
+            status = WS_STATUS_INVALID_PAYLOAD;
+            goto failed;
+        }
+    }
+    libws__frame_free(&wh->ws_p, f);
+    if (!used) {
+        libws__free(wh->a, out);
+        out = 0;
+    }
+    f->rsv1 = 0;
+    f->owned = out != 0;
+    f->payload.data = out;
+    f->payload.length = used;
+    return 0;
+
+failed:
+    libws__free(wh->a, out);
+    libws__frame_free(&wh->ws_p, f);
+    __fail(wh, status);
+    return -1;
+}
+
+/**
+ * check the payload of a close frame, return its status, WS_STATUS_STATUS_NOT_AVAILABLE
+ * when it has none, -1 when it is malformed or -2 when the reason is not UTF-8
+ */
+static int
+__close_status(struct libwshttp *wh, struct libws_b *payload) {
+    const unsigned char *d = (const unsigned char *)payload->data;
+    uint32_t state = WS_UTF8_ACCEPT;
+    int status;
+
+    if (payload->length == 0) return WS_STATUS_STATUS_NOT_AVAILABLE;
+    if (payload->length == 1) return -1;
+    status = d[0] << 8 | d[1];
+    /* 1004 to 1006 and 1015 are never sent, 1016 to 2999 are not assigned */
+    if (status < 1000 || (status >= 1004 && status <= 1006) || (status >= 1015 && status < 3000) || status >= 5000)
+        return -1;
+    if (wh->mode & LIBWSHTTP_MODE_UTF8) {
+        libws__mask_utf8(payload->data + 2, "\0\0\0\0", payload->data + 2, payload->length - 2, 0, &state);
+        if (state != WS_UTF8_ACCEPT) return -2;
+    }
+    return status;
 }
 
 int
 libwshttp__feed(struct libwshttp *wh, struct libws_b *b, struct libwshttp_event *evt) {
-    static http_parser_settings settings = {
-        .on_message_begin = __on_message_begin,
-        .on_url = __on_url,
-        .on_status = __on_status,
-        .on_header_field = __on_header_field,
-        .on_header_value = __on_header_value,
-        .on_headers_complete = __on_headers_complete,
-        .on_body = __on_body,
-        .on_message_complete = __on_message_complete
-    };
-
+    if (wh->failed) return -1;
     if (b->length == 0) return 0;
 
     if (!wh->handshake) {
-        int parsed = http_parser_execute(&wh->http_p, &settings, b->data, b->length);
-        if (wh->http_p.http_errno) {
-            fprintf(stderr, "http_parser_execute: %s %s\n", http_errno_name(wh->http_p.http_errno), http_errno_description(wh->http_p.http_errno));
+        int rc = __http_feed(wh, b);
+        if (rc < 0) {
+            wh->failed = 1;
             return -1;
         }
-        b->length -= parsed;
-        b->data += parsed;
-        if (wh->handshake) {
+        if (rc) {
+            memset(&evt->f, 0, sizeof evt->f);
             evt->event = LIBWSHTTP_OPEN;
             return 1;
         }
@@ -254,61 +1384,293 @@ libwshttp__feed(struct libwshttp *wh, struct libws_b *b, struct libwshttp_event
     } else {
         int rc;
 
-        rc = libws__parser_execute(&wh->ws_p, b, &evt->f);
-        if (rc <= 0) {
+        for (;;) {
+            if (wh->mode & LIBWSHTTP_MODE_MESSAGE)
+                libws__parser_limit(&wh->ws_p, __message_budget(wh));
+            rc = libws__parser_execute(&wh->ws_p, b, &evt->f);
+            if (rc < 0) {
+                __fail(wh, wh->ws_p.error);
+                return -1;
+            }
+            if (rc == 0) {
+                return 0;
+            }
+            if (evt->f.opcode == WS_OPCODE_PING) {
+                /* the payload is in b or in the parser, the pong is sent or queued from there */
+                libwshttp__write(wh, WS_OPCODE_PONG, &evt->f.payload);
+                continue;
+            }
+            if (evt->f.opcode == WS_OPCODE_CLOSE) {
+                int status = __close_status(wh, &evt->f.payload);
+                if (status < 0) {
+                    __fail(wh, status == -2 ? WS_STATUS_INVALID_PAYLOAD : WS_STATUS_PROTOCOL_ERROR);
+                    return -1;
+                }
+                /* answer with the same status, unless this end closed first */
+                libwshttp__close(wh, status == WS_STATUS_STATUS_NOT_AVAILABLE ? WS_STATUS_NORMAL : status, "");
+            }
+            if (!(evt->f.opcode & 0x8)) {
+                /* only the first frame of a compressed message carries RSV1 */
+                if (evt->f.opcode != WS_OPCODE_CONTINUATION) {
+                    wh->inflating = evt->f.rsv1;
+                    wh->inflate_text = evt->f.opcode == WS_OPCODE_TEXT;
+                    wh->inflate_utf8 = WS_UTF8_ACCEPT;
+                }
+                if (wh->inflating && __inflate(wh, &evt->f))
+                    return -1;
+            }
+            if ((wh->mode & LIBWSHTTP_MODE_MESSAGE) && !(evt->f.opcode & 0x8)) {
+                rc = __message(wh, &evt->f);
+                if (rc < 0) {
+                    return -1;
+                }
+                if (rc == 0) {
+                    continue;
+                }
+            }
+            if (evt->f.opcode == WS_OPCODE_CLOSE) {
+                evt->event = LIBWSHTTP_CLOSE;
+            } else {
+                evt->event = LIBWSHTTP_DATA;
+            }
             return rc;
         }
-        if (evt->f.opcode == WS_OPCODE_PING) {
-            struct libws_b dummy = {0, 0};
-            libwshttp__write(wh, WS_OPCODE_PONG, &dummy);
-            return 0;
-        }
-        if (evt->f.opcode == WS_OPCODE_CLOSE) {
-            evt->event = LIBWSHTTP_CLOSE;
-        } else {
-            evt->event = LIBWSHTTP_DATA;
+    }
+}
+
+void
+libwshttp__free(struct libwshttp *wh, struct libwshttp_event *evt) {
+    libws__frame_free(&wh->ws_p, &evt->f);
+}
+
+/**
+ * compress payload as one message, return -2 when it is left to be sent as is
+ */
+static int
+__write_deflate(struct libwshttp *wh, int flags, struct libws_b *payload, int lane) {
+    z_stream *z = __zstream(wh, 1);
+    struct libws_b zb;
+    char *data, *p;
+    uint64_t size, used;
+    int rc;
+
+    /* the compressor never saw it, so the peer may get it uncompressed */
+    if (!z || payload->length > UINT_MAX)
+        return -2;
+    size = deflateBound(z, (uLong)payload->length) + 16;
+    data = (char *)libws__alloc(wh->a, (size_t)size);
+    if (!data) return -1;
+    z->next_in = (Bytef *)payload->data;
+    z->avail_in = (uInt)payload->length;
+    used = 0;
+    for (;;) {
+        z->next_out = (Bytef *)data + used;
+        z->avail_out = (uInt)(size - used);
+        deflate(z, Z_SYNC_FLUSH);
+        used = (char *)z->next_out - data;
+        if (z->avail_out)
+            break;
+        size *= 2;
+        if (!(p = (char *)libws__realloc(wh->a, data, (size_t)size))) {
+            libws__free(wh->a, data);
+            return -1;
         }
-        return rc;
+        data = p;
     }
+    __zstream_done(wh, 1);
+
+    /* the sync flush ends with an empty stored block, the receiver adds it back */
+    if (used >= 4 && !memcmp(data + used - 4, "\0\0\xff\xff", 4))
+        used -= 4;
+    WS_BUILD_RSV1(flags);
+    zb.data = data;
+    zb.length = used;
+    rc = __send_message(wh, flags, &zb, lane, 1);
+    libws__free(wh->a, data);
+    return rc;
 }
 
 int
 libwshttp__write(struct libwshttp *wh, int opcode, struct libws_b *payload) {
-    char *data;
+    return libwshttp__write_priority(wh, opcode, payload, LIBWSHTTP_PRIORITY_NORMAL);
+}
+
+int
+libwshttp__write_priority(struct libwshttp *wh, int opcode, struct libws_b *payload, int priority) {
+    int flags = 0;
+    int lane, rc;
+
+    if (wh->closed) return -1;
+    WS_BUILD_OPCODE(flags, opcode);
+    if (!wh->issrv) WS_BUILD_MASK(flags);
+    if (opcode & 0x8)
+        lane = 0;
+    else if (priority >= LIBWSHTTP_PRIORITY_HIGH && priority <= LIBWSHTTP_PRIORITY_LOW)
+        lane = priority;
+    else
+        lane = LIBWSHTTP_PRIORITY_NORMAL;
+
+    if (wh->pmd == 2 && !(opcode & 0x8) && payload->length >= LIBWSHTTP_DEFLATE_MIN_SIZE) {
+        /* with context takeover the peer inflates in the order we compressed */
+        if (!__no_context_takeover(wh, 1))
+            lane = LIBWSHTTP_PRIORITY_NORMAL;
+        rc = __write_deflate(wh, flags, payload, lane);
+        if (rc != -2) return rc;
+    }
+    return __send_message(wh, flags, payload, lane, 0);
+}
+
+/**
+ * compress payload on its own, as a message without context takeover,
+ * into a malloced buffer. return the length or 0 when it is not smaller
+ */
+static uint64_t
+__deflate_alone(const struct libws_allocator *a, const struct libws_b *payload, int bits, char **out) {
+    z_stream z;
+    uint64_t size, used;
+
+    *out = 0;
+    if (payload->length > UINT_MAX) return 0;
+    memset(&z, 0, sizeof z);
+    if (deflateInit2(&z, LIBWSHTTP_DEFLATE_LEVEL, Z_DEFLATED, -bits, __mem_level(bits), Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    /* a result larger than the payload is of no use, so the bound needs no growth */
+    size = payload->length;
+    *out = (char *)libws__alloc(a, (size_t)size);
+    if (*out) {
+        z.next_in = (Bytef *)payload->data;
+        z.avail_in = (uInt)payload->length;
+        z.next_out = (Bytef *)*out;
+        z.avail_out = (uInt)size;
+        deflate(&z, Z_SYNC_FLUSH);
+        used = size - z.avail_out;
+        if (z.avail_out && z.avail_in == 0 && used >= 4 && !memcmp(*out + used - 4, "\0\0\xff\xff", 4)) {
+            deflateEnd(&z);
+            return used - 4;
+        }
+    }
+    deflateEnd(&z);
+    libws__free(a, *out);
+    *out = 0;
+    return 0;
+}
+
+struct libwshttp_prepared *
+libwshttp__prepare(const struct libws_allocator *a, int opcode, const struct libws_b *payload, int window_bits) {
+    struct libwshttp_prepared *pm;
+    struct libws_b zb = {0, 0};
     uint64_t size;
     int flags = 0;
-    int rc;
+    char *p;
+
+    if (window_bits && !(opcode & 0x8) && payload->length >= LIBWSHTTP_DEFLATE_MIN_SIZE)
+        zb.length = __deflate_alone(a, payload, window_bits, &zb.data);
+    size = sizeof *pm + libws__build_size(0, payload->length);
+    if (zb.data)
+        size += libws__build_size(0, zb.length);
+    pm = (struct libwshttp_prepared *)libws__alloc(a, (size_t)size);
+    if (!pm) {
+        libws__free(a, zb.data);
+        return 0;
+    }
+    memset(pm, 0, sizeof *pm);
+    pm->refs = 1;
+    pm->opcode = opcode;
+    pm->a = a;
+    p = (char *)(pm + 1);
 
-    size = libws__build_size(wh->issrv ? 0 : 1, payload->length);
-    data = malloc(size);
     WS_BUILD_OPCODE(flags, opcode);
     WS_BUILD_FIN(flags);
-    if (!wh->issrv) WS_BUILD_MASK(flags);
-    libws__build(data, flags, payload);
-    rc = wh->write(wh->io, data, size);
-    free(data);
-    return rc;
+    pm->frame.data = p;
+    pm->frame.length = libws__build_size(0, payload->length);
+    libws__build(p, flags, (struct libws_b *)payload);
+    pm->payload.data = p + pm->frame.length - payload->length;
+    pm->payload.length = payload->length;
+    if (zb.data) {
+        WS_BUILD_RSV1(flags);
+        pm->window_bits = window_bits;
+        pm->deflated.data = p + pm->frame.length;
+        pm->deflated.length = libws__build_size(0, zb.length);
+        libws__build(pm->deflated.data, flags, &zb);
+        libws__free(a, zb.data);
+    }
+    return pm;
+}
+
+struct libwshttp_prepared *
+libwshttp__prepared_retain(struct libwshttp_prepared *pm) {
+    pm->refs++;
+    return pm;
+}
+
+void
+libwshttp__prepared_release(struct libwshttp_prepared *pm) {
+    if (pm && --pm->refs == 0)
+        libws__free(pm->a, pm);
+}
+
+int
+libwshttp__write_prepared(struct libwshttp *wh, struct libwshttp_prepared *pm) {
+    struct libws_b *b = &pm->frame;
+
+    if (!wh->issrv || wh->closed) return -1;
+    if (wh->pmd == 2 && !(pm->opcode & 0x8) && pm->payload.length >= LIBWSHTTP_DEFLATE_MIN_SIZE) {
+        /* a shared frame only fits a peer which drops the window after every message */
+        if (!__no_context_takeover(wh, 1))
+            return libwshttp__write(wh, pm->opcode, &pm->payload);
+        if (pm->deflated.length && pm->window_bits <= __window_bits(wh, 1))
+            b = &pm->deflated;
+    }
+    return __send(wh, b, 1, LIBWSHTTP_PRIORITY_NORMAL, 0, pm);
 }
 
 void
 libwshttp__close(struct libwshttp *wh, int close_status, const char *reason) {
     struct libws_b b;
     int len = strlen(reason);
-    char payload[2 + len];
-    uint16_t s = (uint16_t)((close_status & 0xff00) >> 8 | (close_status & 0xff) << 8);
-    char *p = (char *)&s;
-    memcpy(payload, p, sizeof s);
-    memcpy(payload + sizeof s, reason, len);
+    char payload[WS_CONTROL_MAX];
+    int flags = 0;
+
+    if (wh->closed) return;
+    if (len > WS_CONTROL_MAX - 2)
+        len = WS_CONTROL_MAX - 2;
+    payload[0] = (char)(close_status >> 8);
+    payload[1] = (char)close_status;
+    memcpy(payload + 2, reason, len);
     b.data = payload;
     b.length = len + 2;
 
-    libwshttp__write(wh, WS_OPCODE_CLOSE, &b);
-    wh->close(wh->io);
+    WS_BUILD_OPCODE(flags, WS_OPCODE_CLOSE);
+    if (!wh->issrv) WS_BUILD_MASK(flags);
+    /* the last frame, after all the queued ones */
+    __send_message(wh, flags, &b, LIBWSHTTP_LANE_CLOSE, 0);
+    wh->closed = 1;
+    if (!wh->out_pending)
+        wh->close(wh->io);
 }
 
 void
 libwshttp__destroy(struct libwshttp *wh) {
-    free(wh);
+    struct libwshttp_out *o;
+    int i;
+
+    for (i = 0; i < LIBWSHTTP_LANES; i++) {
+        while ((o = wh->out[i].head)) {
+            wh->out[i].head = o->next;
+            __out_free(wh, o);
+        }
+    }
+    libws__parser_free(&wh->ws_p);
+    libws__free(wh->a, wh->msg);
+    libws__free(wh->a, wh->http);
+    /* a stream borrowed in the middle of a message is reset back to the pool */
+    __zstream_done(wh, 1);
+    __zstream_done(wh, 0);
+    if (wh->deflater)
+        __zstream_free(wh->deflater, 1);
+    if (wh->inflater)
+        __zstream_free(wh->inflater, 0);
+    libws__free(wh->a, wh);
 }
 
 #endif /* LIBWSHTTP_IMPLEMENTATION */
@@ -0,0 +1,88 @@
+/*
+ * accept.c -- Sec-WebSocket-Accept with every SHA-1 kernel the cpu supports,
+ * the example of RFC 6455 and other keys, then in batches which are not
+ * multiples of the lanes with every kernel of libws__generate_accept_many().
+ */
+
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+    const char *key;
+    const char *accept;
+} vectors[] = {
+    {"dGhlIHNhbXBsZSBub25jZQ==", "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="}, /* RFC 6455, 1.3 */
+    {"x3JJHMbDL1EzLkh9GBhXDw==", "HSmrc0sMlYUkAGmm5OPpG2HaGWk="},
+    {"AQIDBAUGBwgJCgsMDQ4PEA==", "C/0nmHhBztSRGR1CwL6Tf4ZjwpY="},
+    {"/////////////////////w==", "XXpj4jYzLM2yUE0C7TIgMwTQh2g="},
+};
+
+#define VECTORS (int)(sizeof vectors / sizeof vectors[0])
+#define MAX_BATCH 64
+
+/** n keys at once against one by one, the accepts after n left alone */
+static int
+__many(const char *name, char keys[][WS_KEY_LEN], char expect[][WS_ACCEPT_LEN], int n) {
+    char accepts[MAX_BATCH + 1][WS_ACCEPT_LEN];
+    char *accept[MAX_BATCH];
+    const char *key[MAX_BATCH];
+    int i;
+
+    memset(accepts, '#', sizeof accepts);
+    for (i = 0; i < n; i++) {
+        key[i] = keys[i];
+        accept[i] = accepts[i];
+    }
+    libws__generate_accept_many(accept, key, n);
+    for (i = 0; i <= n; i++) {
+        if (i < n ? memcmp(accepts[i], expect[i], WS_ACCEPT_LEN) : accepts[i][0] != '#') {
+            fprintf(stderr, "%s: batch of %d, accept %d is %.*s, expected %.*s\n", name, n, i, WS_ACCEPT_LEN,
+                    accepts[i], WS_ACCEPT_LEN, i < n ? expect[i] : "#");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+main(void) {
+    static const int batches[] = {0, 1, 2, 4, 7, 8, 15, 16, 17, 37, MAX_BATCH};
+    char accept[WS_ACCEPT_LEN], keys[MAX_BATCH][WS_KEY_LEN], expect[MAX_BATCH][WS_ACCEPT_LEN];
+    int k, i, scalar = 0, kernels = 0, many = 0;
+
+    for (k = 0; k < (int)(sizeof sha1_kernels / sizeof sha1_kernels[0]); k++) {
+        if (!sha1_supported(sha1_kernels[k].name)) continue;
+        sha1_kernel = k;
+        kernels++;
+        for (i = 0; i < VECTORS; i++) {
+            libws__generate_accept(accept, vectors[i].key);
+            if (memcmp(accept, vectors[i].accept, WS_ACCEPT_LEN)) {
+                fprintf(stderr, "%s: accept of %s is %.*s, expected %s\n", sha1_kernels[k].name, vectors[i].key,
+                        WS_ACCEPT_LEN, accept, vectors[i].accept);
+                return 1;
+            }
+        }
+        if (!strcmp(sha1_kernels[k].name, "scalar")) scalar = k;
+    }
+
+    /* the lanes of a short batch are filled with its last key */
+    for (i = 0; i < MAX_BATCH; i++) {
+        libws__generate_key(keys[i]);
+        sha1_kernel = scalar;
+        libws__generate_accept(expect[i], keys[i]);
+    }
+    for (k = 0; k < (int)(sizeof sha1_many_kernels / sizeof sha1_many_kernels[0]); k++) {
+        if (!sha1_many_supported(sha1_many_kernels[k].name)) continue;
+        sha1_many_kernel = k;
+        many++;
+        for (i = 0; i < (int)(sizeof batches / sizeof batches[0]); i++) {
+            if (__many(sha1_many_kernels[k].name, keys, expect, batches[i])) return 1;
+        }
+    }
+    printf("%d SHA-1 kernels and %d batch kernels checked\n", kernels, many);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * ae_timer.c -- the time events of ae on a clock the test moves: ids stay
+ * valid when their sequence wraps, the wheel fires every timer at its time
+ * across its levels and the overflow list, with deletes and reschedules.
+ */
+
+#include <time.h>
+
+static long long now_ms = 1000000;
+
+static int
+__clock_gettime(clockid_t clock, struct timespec *ts) {
+    (void)clock;
+    ts->tv_sec = now_ms / 1000;
+    ts->tv_nsec = (now_ms % 1000) * 1000000;
+    return 0;
+}
+
+#define clock_gettime __clock_gettime
+#include "../lib/ae.c"
+#undef clock_gettime
+
+#define TIMERS 8
+
+static int fired[TIMERS];
+
+static int
+__fire(aeEventLoop *el, long long id, void *clientData) {
+    (void)el;
+    (void)id;
+    fired[(long)clientData]++;
+    return AE_NOMORE;
+}
+
+static void
+__advance(aeEventLoop *el, long long ms) {
+    now_ms += ms;
+    aeProcessEvents(el, AE_TIME_EVENTS | AE_DONT_WAIT);
+}
+
+/** create timers around the wrap of the sequence, delete half of them */
+static int
+__wrap(aeEventLoop *el, unsigned long long seq) {
+    long long id[TIMERS];
+    int i;
+
+    el->timeEventNextId = seq;
+    memset(fired, 0, sizeof fired);
+    for (i = 0; i < TIMERS; i++) {
+        id[i] = aeCreateTimeEvent(el, 10, __fire, (void *)(long)i, NULL);
+        if (id[i] < 0 || id[i] == AE_DELETED_EVENT_ID) {
+            fprintf(stderr, "sequence %llx: timer %d has id %lld\n", seq, i, id[i]);
+            return -1;
+        }
+    }
+    for (i = 0; i < TIMERS; i += 2) {
+        if (aeDeleteTimeEvent(el, id[i]) != AE_OK) {
+            fprintf(stderr, "sequence %llx: timer %d not deleted\n", seq, i);
+            return -1;
+        }
+        if (aeDeleteTimeEvent(el, id[i]) != AE_ERR) {
+            fprintf(stderr, "sequence %llx: timer %d deleted twice\n", seq, i);
+            return -1;
+        }
+    }
+    __advance(el, 10);
+    for (i = 0; i < TIMERS; i++) {
+        if (fired[i] != i % 2) {
+            fprintf(stderr, "sequence %llx: timer %d fired %d times\n", seq, i, fired[i]);
+            return -1;
+        }
+    }
+    if (el->timeEvents) {
+        fprintf(stderr, "sequence %llx: %d timers left\n", seq, el->timeEvents);
+        return -1;
+    }
+    return 0;
+}
+
+struct wheel {
+    long long delay;
+    long long id;
+    int times; /* the proc deletes or reschedules itself, see __tick() */
+};
+
+static struct wheel wheel[] = {
+    {0, 0, 0}, {1, 0, 0}, {63, 0, 0}, {64, 0, 0}, {4095, 0, 0},
+    {4096, 0, 0}, {1 << 18, 0, 0}, {(1 << 24) + 1, 0, 0},
+};
+
+#define WHEEL (int)(sizeof wheel / sizeof wheel[0])
+
+static struct {
+    int timer;
+    long long at;
+} got[2 * WHEEL];
+
+static int got_length;
+static long long start;
+
+static int
+__tick(aeEventLoop *el, long long id, void *clientData) {
+    struct wheel *w = &wheel[(long)clientData];
+
+    if (w->id != id || got_length == 2 * WHEEL) return AE_NOMORE;
+    got[got_length].timer = (int)(long)clientData;
+    got[got_length++].at = now_ms - start;
+    w->times++;
+    switch (w->delay) {
+    case 1:
+        /* an other one, before its time */
+        aeDeleteTimeEvent(el, wheel[5].id);
+        return AE_NOMORE;
+    case 64:
+        /* itself, the value returned is not used then */
+        aeDeleteTimeEvent(el, id);
+        return 100;
+    case 4095:
+        return w->times == 1 ? 5000 : AE_NOMORE;
+    default:
+        return AE_NOMORE;
+    }
+}
+
+/** let the loop sleep as long as it asks until every timer is done */
+static int
+__wheel(aeEventLoop *el) {
+    static const struct {
+        int timer;
+        long long at;
+    } expect[] = {
+        {0, 0}, {1, 1}, {3, 64}, {4, 4095}, {4, 4095 + 5000}, {6, 1 << 18}, {7, (1 << 24) + 1},
+    };
+    int i, n = (int)(sizeof expect / sizeof expect[0]), steps = 0;
+
+    start = now_ms;
+    aeProcessEvents(el, AE_TIME_EVENTS | AE_DONT_WAIT);
+    for (i = 0; i < WHEEL; i++)
+        wheel[i].id = aeCreateTimeEvent(el, wheel[i].delay, __tick, (void *)(long)i, NULL);
+    aeDeleteTimeEvent(el, wheel[2].id);
+
+    while (el->timeEvents && steps++ < 10000) {
+        long long ms = aeWheelTimeout(el, now_ms);
+
+        if (ms < 0) break;
+        __advance(el, ms);
+    }
+    if (el->timeEvents) {
+        fprintf(stderr, "wheel: %d timers left after %d steps\n", el->timeEvents, steps);
+        return -1;
+    }
+    for (i = 0; i < got_length || i < n; i++) {
+        if (i >= got_length || i >= n || got[i].timer != expect[i].timer || got[i].at != expect[i].at) {
+            fprintf(stderr, "wheel: fired %d: timer %d at %lld, expected timer %d at %lld\n", i,
+                i < got_length ? got[i].timer : -1, i < got_length ? got[i].at : -1LL,
+                i < n ? expect[i].timer : -1, i < n ? expect[i].at : -1LL);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+main(void) {
+    aeEventLoop *el = aeCreateEventLoop(64);
+
+    if (el == NULL) {
+        fprintf(stderr, "no event loop\n");
+        return 1;
+    }
+    if (__wrap(el, 0) || __wrap(el, 0x7fffffffULL - TIMERS / 2) || __wrap(el, 0xffffffffULL - TIMERS / 2) ||
+        __wrap(el, ~0ULL - TIMERS / 2))
+        return 1;
+    if (__wheel(el))
+        return 1;
+
+    aeDeleteEventLoop(el);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * deflate_priority.c -- messages of mixed priorities with permessage-deflate
+ * and context takeover are inflated by the peer in the order they were sent.
+ */
+
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES 32
+
+struct pipe {
+    char data[1 << 20];
+    int length;
+    int hold;   /* the writev side is full */
+};
+
+static struct pipe s2c, c2s;
+
+static int
+_write(void *io, const char *data, int size) {
+    struct pipe *p = (struct pipe *)io;
+
+    if (p->length + size > (int)sizeof p->data) return -1;
+    memcpy(p->data + p->length, data, size);
+    p->length += size;
+    return 0;
+}
+
+static int
+_writev(void *io, const struct libws_b *b, int n) {
+    struct pipe *p = (struct pipe *)io;
+    int i, nwritten = 0;
+
+    if (p->hold) return 0;
+    for (i = 0; i < n; i++) {
+        if (_write(io, b[i].data, (int)b[i].length)) return -1;
+        nwritten += (int)b[i].length;
+    }
+    return nwritten;
+}
+
+static void
+_wait(void *io, int on) {
+    (void)io;
+    (void)on;
+}
+
+static void
+_close(void *io) {
+    (void)io;
+}
+
+/** feed what p holds to wh, return the number of data events, -1 on error */
+static int
+__pump(struct libwshttp *wh, struct pipe *p, char (*got)[128], int *got_length) {
+    struct libwshttp_event evt;
+    struct libws_b b;
+    int rc, n = 0;
+
+    b.data = p->data;
+    b.length = p->length;
+    while ((rc = libwshttp__feed(wh, &b, &evt)) > 0) {
+        if (evt.event == LIBWSHTTP_DATA && got) {
+            if (evt.f.payload.length >= sizeof got[0]) return -1;
+            memcpy(got[n], evt.f.payload.data, evt.f.payload.length);
+            got_length[n++] = (int)evt.f.payload.length;
+        }
+        libwshttp__free(wh, &evt);
+    }
+    p->length = 0;
+    return rc < 0 ? -1 : n;
+}
+
+static int
+__text(char *buf, int i) {
+    int priority = LIBWSHTTP_PRIORITY_LOW - i % 3;
+
+    return sprintf(buf, "message %02d of priority %d, long enough to be compressed and alike to the others", i, priority);
+}
+
+int
+main(void) {
+    struct libwshttp *srv, *cli;
+    struct libws_deflate d = {0, 0, 0, 0};
+    struct libws_b b;
+    char buf[128], got[MESSAGES][128];
+    int got_length[MESSAGES];
+    int i, n, last[LIBWSHTTP_LANES];
+
+    srv = libwshttp__create(1, &s2c, _write, _close);
+    cli = libwshttp__create(0, &c2s, _write, _close);
+    libwshttp__set_writev(srv, _writev);
+    libwshttp__set_queue(srv, _wait);
+    libwshttp__set_mode(srv, LIBWSHTTP_MODE_MESSAGE);
+    libwshttp__set_mode(cli, LIBWSHTTP_MODE_MESSAGE);
+    libwshttp__set_deflate(srv, &d);
+    libwshttp__set_deflate(cli, &d);
+
+    libwshttp__request(cli, "/", "localhost", "ws");
+    if (__pump(srv, &c2s, 0, 0) < 0 || __pump(cli, &s2c, 0, 0) < 0) {
+        fprintf(stderr, "handshake failed\n");
+        return 1;
+    }
+    if (srv->pmd != 2 || cli->pmd != 2) {
+        fprintf(stderr, "permessage-deflate not agreed\n");
+        return 1;
+    }
+
+    /* queue them all, low first, so that the lanes would reorder them */
+    s2c.hold = 1;
+    for (i = 0; i < MESSAGES; i++) {
+        b.data = buf;
+        b.length = __text(buf, i);
+        if (libwshttp__write_priority(srv, WS_OPCODE_TEXT, &b, LIBWSHTTP_PRIORITY_LOW - i % 3)) {
+            fprintf(stderr, "write %d failed\n", i);
+            return 1;
+        }
+    }
+    s2c.hold = 0;
+    if (libwshttp__flush(srv) != 0) {
+        fprintf(stderr, "flush failed\n");
+        return 1;
+    }
+
+    n = __pump(cli, &s2c, got, got_length);
+    if (n != MESSAGES) {
+        fprintf(stderr, "got %d of %d messages\n", n, MESSAGES);
+        return 1;
+    }
+    for (i = 0; i < LIBWSHTTP_LANES; i++)
+        last[i] = -1;
+    for (i = 0; i < n; i++) {
+        int j, priority;
+
+        if (sscanf(got[i], "message %d of priority %d", &j, &priority) != 2 || j < 0 || j >= MESSAGES ||
+            got_length[i] != __text(buf, j) || memcmp(got[i], buf, got_length[i])) {
+            fprintf(stderr, "message %d is corrupt: %.*s\n", i, got_length[i], got[i]);
+            return 1;
+        }
+        if (j < last[priority]) {
+            fprintf(stderr, "message %d came after %d of the same priority\n", j, last[priority]);
+            return 1;
+        }
+        last[priority] = j;
+    }
+
+    libwshttp__destroy(srv);
+    libwshttp__destroy(cli);
+    return 0;
+}
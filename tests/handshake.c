@@ -0,0 +1,194 @@
+/*
+ * handshake.c -- upgrade heads fed to a server session split at every byte:
+ * the valid ones are answered with 101 and the frame behind them is read,
+ * the others fail without an answer. The 101 is read back by a client the
+ * same way.
+ */
+
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define ACCEPT "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+/* a masked text frame of "hi", right behind the head */
+#define FRAME "\x81\x82\x01\x02\x03\x04\x69\x6b"
+
+struct pipe {
+    char data[4096 + 1]; /* room for a nul */
+    int length;
+};
+
+static struct pipe out;
+
+static int
+_write(void *io, const char *data, int size) {
+    struct pipe *p = (struct pipe *)io;
+
+    if (p->length + size >= (int)sizeof p->data) return -1;
+    memcpy(p->data + p->length, data, size);
+    p->length += size;
+    return 0;
+}
+
+static void
+_close(void *io) {
+    (void)io;
+}
+
+/** feed n bytes of data, opened and got are set by the events, -1 on error */
+static int
+__pump(struct libwshttp *wh, const char *data, int n, int *opened, int *got) {
+    struct libwshttp_event evt;
+    struct libws_b b;
+    int rc;
+
+    b.data = (char *)data;
+    b.length = n;
+    while ((rc = libwshttp__feed(wh, &b, &evt)) > 0) {
+        if (evt.event == LIBWSHTTP_OPEN) (*opened)++;
+        if (evt.event == LIBWSHTTP_DATA && evt.f.payload.length == 2 && !memcmp(evt.f.payload.data, "hi", 2))
+            (*got)++;
+        libwshttp__free(wh, &evt);
+    }
+    return rc;
+}
+
+/**
+ * a server session fed head and FRAME in two reads cut at cut,
+ * 1 when answered with 101 and the frame read, -1 when it failed
+ * without an answer, 0 otherwise
+ */
+static int
+__serve(const char *head, int cut) {
+    struct libwshttp *wh;
+    char data[2048];
+    int n, opened = 0, got = 0, rc;
+
+    n = snprintf(data, sizeof data, "%s%s", head, FRAME);
+    out.length = 0;
+    wh = libwshttp__create(1, &out, _write, _close);
+    rc = __pump(wh, data, cut, &opened, &got);
+    if (rc >= 0) rc = __pump(wh, data + cut, n - cut, &opened, &got);
+    libwshttp__destroy(wh);
+    if (rc < 0) return out.length ? 0 : -1;
+    if (opened != 1 || got != 1 || out.length < 12 || memcmp(out.data, "HTTP/1.1 101", 12)) return 0;
+    out.data[out.length] = '\0';
+    return strstr(out.data, "\r\nSec-WebSocket-Accept: " ACCEPT "\r\n") ? 1 : 0;
+}
+
+static const char *valid[] = {
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: " KEY "\r\n"
+    "Origin: http://example.com\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n",
+    /* names in any case, values trimmed, a list of connection options */
+    "GET / HTTP/1.1\r\n"
+    "host:x\r\n"
+    "UPGRADE: \t WebSocket \t\r\n"
+    "connection:keep-alive, upgrade\r\n"
+    "sec-websocket-key:" KEY "  \r\n"
+    "sec-websocket-version:13\r\n"
+    "\r\n",
+};
+
+static const struct {
+    const char *what;
+    const char *head;
+} invalid[] = {
+    {"folded line",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key:\r\n " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"bare LF",
+     "GET / HTTP/1.1\r\nHost: x\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"bare LF of the request line",
+     "GET / HTTP/1.1\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"POST",
+     "POST / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"HTTP/1.0",
+     "GET / HTTP/1.0\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"a name only prefixed by Upgrade",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade-X: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"a name only prefixed by Sec-WebSocket-Key",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Keys: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"a space before the colon",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade : websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"Sec-WebSocket-Version: 1",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 1\r\n\r\n"},
+    {"a key too short",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ=\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+    {"no Connection",
+     "GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\n"
+     "Sec-WebSocket-Key: " KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n"},
+};
+
+/** the 101 of the server read by a client, split at every byte */
+static int
+__client(void) {
+    struct libwshttp *srv, *cli;
+    struct pipe request, response;
+    int cut, opened, got, rc = 0;
+
+    for (cut = 0; !rc; cut++) {
+        request.length = response.length = 0;
+        opened = got = 0;
+        srv = libwshttp__create(1, &response, _write, _close);
+        cli = libwshttp__create(0, &request, _write, _close);
+        libwshttp__request(cli, "/", "localhost", "ws");
+        if (__pump(srv, request.data, request.length, &opened, &got) < 0 || opened != 1) {
+            fprintf(stderr, "client: request refused\n");
+            rc = 1;
+        } else if (cut > response.length) {
+            rc = -1;
+        } else if (opened = 0, __pump(cli, response.data, cut, &opened, &got) < 0 ||
+                   __pump(cli, response.data + cut, response.length - cut, &opened, &got) < 0 || opened != 1) {
+            fprintf(stderr, "client: 101 cut at %d refused\n", cut);
+            rc = 1;
+        }
+        libwshttp__destroy(srv);
+        libwshttp__destroy(cli);
+    }
+    return rc > 0;
+}
+
+int
+main(void) {
+    int i, cut, n, rc;
+
+    for (i = 0; i < (int)(sizeof valid / sizeof valid[0]); i++) {
+        n = (int)strlen(valid[i]) + (int)sizeof FRAME - 1;
+        for (cut = 0; cut <= n; cut++) {
+            if ((rc = __serve(valid[i], cut)) != 1) {
+                fprintf(stderr, "valid head %d cut at %d: %s\n", i, cut, rc < 0 ? "refused" : "no 101");
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < (int)(sizeof invalid / sizeof invalid[0]); i++) {
+        n = (int)strlen(invalid[i].head) + (int)sizeof FRAME - 1;
+        for (cut = 0; cut <= n; cut++) {
+            if ((rc = __serve(invalid[i].head, cut)) != -1) {
+                fprintf(stderr, "%s cut at %d: %s\n", invalid[i].what, cut, rc > 0 ? "accepted" : "not refused");
+                return 1;
+            }
+        }
+    }
+    return __client();
+}
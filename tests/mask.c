@@ -0,0 +1,80 @@
+/*
+ * mask.c -- every masking kernel the cpu supports against the byte loop,
+ * for every length up to 300, unaligned heads and tails, and every offset.
+ */
+
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LENGTH 300
+#define MAX_ALIGN 32
+
+/** the reference, one byte at a time */
+static void
+__mask(char *buff, const char mask[4], const char *payload, uint64_t length, uint64_t offset) {
+    uint64_t i;
+
+    for (i = 0; i < length; i++)
+        buff[i] = payload[i] ^ mask[(offset + i) & 3];
+}
+
+/** mask a copy of payload at align with the kernel, and in place, compared to the reference */
+static int
+__check(int k, const char *payload, int length, int align, int offset) {
+    static const char mask[4] = {(char)0x37, (char)0xfa, (char)0x21, (char)0x3d};
+    static char expect[MAX_LENGTH + 8], src[MAX_LENGTH + MAX_ALIGN + 8], dst[MAX_LENGTH + MAX_ALIGN + 8];
+    char rotated[4];
+    uint32_t key;
+    int i;
+
+    __mask(expect, mask, payload, length, offset);
+    for (i = 0; i < 4; i++)
+        rotated[i] = mask[(offset + i) & 3];
+    memcpy(&key, rotated, 4);
+
+    /* the kernel alone, bytes around the buffer left alone */
+    memcpy(src + align, payload, length);
+    memset(dst, 0x55, sizeof dst);
+    mask_kernels[k].fn(dst + align, src + align, length, key);
+    if (memcmp(dst + align, expect, length)) return -1;
+    for (i = 0; i < (int)sizeof dst; i++)
+        if ((i < align || i >= align + length) && dst[i] != 0x55) return -1;
+
+    /* through libws__mask(), in place */
+    if (libws__mask(src + align, mask, src + align, length, offset) != (uint64_t)((offset + length) & 3)) return -1;
+    if (memcmp(src + align, expect, length)) return -1;
+    return 0;
+}
+
+int
+main(void) {
+    char payload[MAX_LENGTH + 1];
+    int k, length, align, offset, kernels = 0;
+
+    srand(1);
+    for (length = 0; length <= MAX_LENGTH; length++)
+        payload[length] = (char)rand();
+
+    for (k = 0; k < (int)(sizeof mask_kernels / sizeof mask_kernels[0]); k++) {
+        if (!mask_supported(mask_kernels[k].name)) continue;
+        mask_kernel = k;
+        kernels++;
+        for (length = 0; length <= MAX_LENGTH; length++) {
+            for (align = 0; align < MAX_ALIGN; align++) {
+                for (offset = 0; offset < 4; offset++) {
+                    if (__check(k, payload, length, align, offset)) {
+                        fprintf(stderr, "%s: length %d align %d offset %d differs from the byte loop\n",
+                                mask_kernels[k].name, length, align, offset);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    printf("%d masking kernels checked\n", kernels);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * utf8.c -- every fused unmask and UTF-8 kernel the cpu supports against a
+ * scalar validator: valid and invalid sequences at every position of the
+ * blocks, split across calls at every offset, and random texts.
+ */
+
+#define LIBWSHTTP_IMPLEMENTATION
+#include "libwshttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TEXT 256
+
+enum { UTF8_VALID, UTF8_OPEN, UTF8_INVALID };
+
+/** the reference: valid, a character left open at the end, or invalid */
+static int
+__utf8(const unsigned char *s, int n) {
+    int i = 0, j, need;
+    unsigned char lo, hi;
+
+    while (i < n) {
+        unsigned char c = s[i];
+
+        lo = 0x80;
+        hi = 0xbf;
+        if (c < 0x80) {
+            i++;
+            continue;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            need = 1;
+        } else if (c == 0xe0) {
+            need = 2;
+            lo = 0xa0;
+        } else if (c == 0xed) {
+            need = 2;
+            hi = 0x9f; /* no surrogates */
+        } else if (c >= 0xe1 && c <= 0xef) {
+            need = 2;
+        } else if (c == 0xf0) {
+            need = 3;
+            lo = 0x90;
+        } else if (c >= 0xf1 && c <= 0xf3) {
+            need = 3;
+        } else if (c == 0xf4) {
+            need = 3;
+            hi = 0x8f; /* up to U+10FFFF */
+        } else {
+            return UTF8_INVALID;
+        }
+        for (j = 1; j <= need; j++) {
+            if (i + j >= n) return UTF8_OPEN;
+            if (s[i + j] < (j == 1 ? lo : 0x80) || s[i + j] > (j == 1 ? hi : 0xbf)) return UTF8_INVALID;
+        }
+        i += need + 1;
+    }
+    return UTF8_VALID;
+}
+
+static int
+__class(uint32_t state) {
+    return state == WS_UTF8_ACCEPT ? UTF8_VALID : state == WS_UTF8_REJECT ? UTF8_INVALID : UTF8_OPEN;
+}
+
+/**
+ * mask text, then unmask and validate it in calls split at cut1 and cut2 with
+ * libws__mask_utf8(), the state checked after every call
+ */
+static int
+__check(const unsigned char *text, int n, int cut1, int cut2) {
+    static const char mask[4] = {(char)0xa5, (char)0x5a, (char)0x0f, (char)0xf0};
+    char masked[MAX_TEXT], buff[MAX_TEXT];
+    int cuts[3], i, from = 0;
+    uint64_t offset = 0;
+    uint32_t state = WS_UTF8_ACCEPT;
+
+    for (i = 0; i < n; i++)
+        masked[i] = (char)(text[i] ^ (unsigned char)mask[i & 3]);
+    cuts[0] = cut1;
+    cuts[1] = cut2;
+    cuts[2] = n;
+    for (i = 0; i < 3; i++) {
+        if (cuts[i] < from) continue;
+        offset = libws__mask_utf8(buff + from, mask, masked + from, cuts[i] - from, offset, &state);
+        from = cuts[i];
+        if (__class(state) != __utf8(text, from)) return -1;
+    }
+    if (state != WS_UTF8_REJECT && memcmp(buff, text, n)) return -1;
+    return 0;
+}
+
+static int
+__report(int k, const char *what, const unsigned char *text, int n, int cut1, int cut2) {
+    int i;
+
+    fprintf(stderr, "%s: %s, split at %d and %d, expected %d:", mask_kernels[k].name, what, cut1, cut2,
+            __utf8(text, n));
+    for (i = 0; i < n; i++)
+        fprintf(stderr, " %02x", text[i]);
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+static const char *sequences[] = {
+    /* valid, at the bounds */
+    "\xc2\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xed\x9f\xbf", "\xee\x80\x80", "\xef\xbf\xbf",
+    "\xf0\x90\x80\x80", "\xf4\x8f\xbf\xbf", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+    /* overlongs */
+    "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf",
+    /* surrogates */
+    "\xed\xa0\x80", "\xed\xbf\xbf",
+    /* above U+10FFFF */
+    "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xf7\xbf\xbf\xbf", "\xf8\x88\x80\x80\x80", "\xfe", "\xff",
+    /* continuations alone, characters cut by the next one */
+    "\x80", "\xbf", "\xc3\xc3\xa9", "\xe2\x82", "\xf0\x9f\x98", "\xe2\x82\xe2\x82\xac",
+};
+
+/** the text which surrounds a sequence: ascii, then 2, 3 and 4 bytes characters */
+static const char *fillers[] = {"a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80"};
+
+static int
+__fill(unsigned char *text, const char *filler, int length) {
+    int n = 0, l = (int)strlen(filler);
+
+    while (n + l <= length) {
+        memcpy(text + n, filler, l);
+        n += l;
+    }
+    return n;
+}
+
+int
+main(void) {
+    unsigned char text[MAX_TEXT];
+    int k, s, f, head, tail, n, l, cut1, cut2, kernels = 0;
+
+    for (k = 0; k < (int)(sizeof mask_kernels / sizeof mask_kernels[0]); k++) {
+        if (!mask_supported(mask_kernels[k].name)) continue;
+        mask_kernel = k;
+        kernels++;
+
+        /* every sequence at every position of two blocks, the text ends after it or goes on */
+        for (s = 0; s < (int)(sizeof sequences / sizeof sequences[0]); s++) {
+            for (f = 0; f < (int)(sizeof fillers / sizeof fillers[0]); f++) {
+                for (head = 0; head < 70; head++) {
+                    for (tail = 0; tail <= 40; tail += 40) {
+                        n = __fill(text, fillers[f], head);
+                        l = (int)strlen(sequences[s]);
+                        memcpy(text + n, sequences[s], l);
+                        n += l;
+                        n += __fill(text + n, "z", tail);
+                        for (cut1 = 0; cut1 <= n; cut1++) {
+                            if (__check(text, n, cut1, cut1)) return __report(k, "sequence", text, n, cut1, cut1);
+                        }
+                    }
+                }
+            }
+        }
+
+        /* random texts of valid characters and random bytes, split twice */
+        srand(1);
+        for (s = 0; s < 20000; s++) {
+            n = rand() % MAX_TEXT;
+            for (l = 0; l < n;) {
+                const char *c = fillers[rand() % 4];
+                int r = rand() % 256;
+
+                if (r == 0) {
+                    text[l++] = (unsigned char)rand();
+                } else if (l + (int)strlen(c) <= n) {
+                    memcpy(text + l, c, strlen(c));
+                    l += (int)strlen(c);
+                } else {
+                    text[l++] = 'z';
+                }
+            }
+            cut1 = n ? rand() % (n + 1) : 0;
+            cut2 = cut1 + rand() % (n - cut1 + 1);
+            if (__check(text, n, cut1, cut2)) return __report(k, "random", text, n, cut1, cut2);
+        }
+    }
+    printf("%d utf8 kernels checked\n", kernels);
+    return 0;
+}